@@ -115,10 +115,16 @@ struct tlbshootdown {
 	 * Change this to what you need for your VM design.
 	 */
 	struct addrspace *ts_addrspace;
-	vaddr_t ts_vaddr;
+	vaddr_t ts_vaddr;	/* or TLBSHOOTDOWN_ASALL */
 };
 
 #define TLBSHOOTDOWN_MAX 16
 
+/* ts_vaddr that drops every translation of ts_addrspace */
+#define TLBSHOOTDOWN_ASALL ((vaddr_t)1)
+
+/* as_cpumask has one bit per cpu */
+#define VM_MAXCPUS 32
+
 
 #endif /* _MIPS_VM_H_ */
@@ -36,6 +36,7 @@
 #include <current.h>
 #include <syscall.h>
 #include "opt-A2.h"
+#include "opt-A3.h"
 
 /*
  * System call dispatcher.
@@ -138,6 +139,21 @@ syscall(struct trapframe *tf)
 			    (int)tf->tf_a2,
 			    (pid_t *)&retval);
 	  break;
+	#if OPT_A3
+	case SYS_sbrk:
+	  err = sys_sbrk((intptr_t)tf->tf_a0, (vaddr_t *)&retval);
+	  break;
+	case SYS_mmap:
+	  err = sys_mmap((userptr_t)tf->tf_a0,
+			 (size_t)tf->tf_a1,
+			 (int)tf->tf_a2,
+			 (int)tf->tf_a3,
+			 (vaddr_t *)&retval);
+	  break;
+	case SYS_munmap:
+	  err = sys_munmap((vaddr_t)tf->tf_a0, (size_t)tf->tf_a1);
+	  break;
+	#endif /* OPT_A3 */
 #endif // UW
 
 	    /* Add stuff here */
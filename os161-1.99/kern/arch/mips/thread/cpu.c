@@ -223,6 +223,24 @@ cpu_idle(void)
         cpu_irqonoff();
 }
 
+/*
+ * Read the cycle counter.
+ */
+uint32_t
+cpu_cycles(void)
+{
+	uint32_t count;
+
+	/* $9 == c0_count */
+	__asm volatile(
+		".set push;"		/* save assembler mode */
+		".set mips32;"		/* allow MIPS32 registers */
+		"mfc0 %0, $9;"		/* do it */
+		".set pop"		/* restore assembler mode */
+		: "=r" (count));
+	return count;
+}
+
 /*
  * Halt the CPU permanently.
  */
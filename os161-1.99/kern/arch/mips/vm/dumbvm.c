@@ -29,14 +29,24 @@
 
 #include <types.h>
 #include <kern/errno.h>
+#include <kern/mman.h>
+#include <kern/stat.h>
 #include <lib.h>
 #include <spl.h>
 #include <spinlock.h>
 #include <proc.h>
+#include <cpu.h>
 #include <current.h>
 #include <mips/tlb.h>
 #include <addrspace.h>
 #include <vm.h>
+#include <uio.h>
+#include <vnode.h>
+#include <vfs.h>
+#include <uw-vmstats.h>
+#include <synch.h>
+#include <swap.h>
+#include <clock.h>
 #include "opt-A3.h"
 /*
  * Dumb MIPS-only "VM system" that is intended to only be just barely
@@ -53,130 +63,1607 @@ paddr_t lo;
 paddr_t hi;
 int table_size = 0;
 bool stealMem = 1;
+struct pagecache_entry;
+
 struct CoreEntry {
 	paddr_t cm_addr;
 	int cm_blocks;
 	bool cm_valid;
+	int cm_refcount;	/* # of address spaces mapping this frame */
+	/*
+	 * Reverse mapping for page replacement. Only set for a user
+	 * frame with a single owner; kernel frames and frames shared
+	 * copy-on-write have cm_pte == NULL and are never evicted.
+	 */
+	struct addrspace *cm_as;
+	vaddr_t cm_vaddr;
+	paddr_t *cm_pte;
+	bool cm_referenced;	/* second-chance bit for the clock */
+	struct pagecache_entry *cm_cache; /* entry in the page cache, or
+					    NULL */
+	bool cm_dirty;		/* written through a MAP_SHARED mapping */
+	/*
+	 * Buddy allocator state. cm_order is the order of the free
+	 * block this entry heads, or -1; cm_next/cm_prev link heads of
+	 * the same order into free_area[] by core_map index.
+	 */
+	int cm_order;
+	int cm_next;
+	int cm_prev;
 };
 struct CoreEntry* core_map;
+int coremap_nfree = 0;
+
+/*
+ * Free frames are kept in power-of-two blocks, one list per order.
+ * Order 0 is the single-page free list, so the common alloc_kpages(1)
+ * is a list pop; larger runs are split from, and coalesced back into,
+ * bigger blocks. Block alignment is relative to frame_base, the first
+ * frame after the core map itself.
+ */
+#define BUDDY_MAX_ORDER      10
+static int free_area[BUDDY_MAX_ORDER + 1];
+static int frame_base;
+
+/*
+ * A page table entry (an element of a second-level page table)
+ * is 0 for a page that has never been touched, the physical address of
+ * its frame if it is resident, or a swap slot tagged with PTE_SWAPPED.
+ */
+#define PTE_SWAPPED          0x1
+#define PTE_IS_SWAPPED(pte)  (((pte) & PTE_SWAPPED) != 0)
+#define PTE_SLOT(pte)        ((unsigned)((pte) >> 12))
+#define PTE_MKSWAP(slot)     (((paddr_t)(slot) << 12) | PTE_SWAPPED)
+
+/*
+ * User pages are evicted once fewer than this many frames are free,
+ * so that kmalloc, which cannot evict, does not run dry.
+ */
+#define VM_RESERVE_PAGES     8
+
+/*
+ * Frames zeroed ahead of time by idle cpus, for zero-fill faults and
+ * segment setup. The idle loop only tops the pool up while memory is
+ * plentiful, so it never causes eviction.
+ */
+#define ZERO_POOL_SIZE       16
+#define ZERO_POOL_MINFREE    (2 * VM_RESERVE_PAGES)
+
+/*
+ * On a TLB miss, also load translations for up to this many of the
+ * following pages of the same region, if they are already resident.
+ * 0 turns fault-around off.
+ */
+#define VM_FAULTAROUND       4
+
+/*
+ * Page cache for file pages that several processes map at once: the
+ * text of a shared executable, and every page of a MAP_SHARED mmap.
+ * An entry is keyed by the vnode and by which bytes of the file the
+ * page holds; a MAP_SHARED page always holds a whole page of the
+ * file. The entry does not hold a reference on the frame: it goes
+ * away when the last mapping does, and since every mapping belongs to
+ * a region that holds the vnode open, a cached vnode is never
+ * recycled while its entry lives.
+ *
+ * A MAP_SHARED page is written through every mapping of it, and
+ * cm_dirty is set on its frame by the first write fault. It goes back
+ * to the file when its last mapping is removed (see as_unmap_region);
+ * until then a dirty cached frame is never evicted. A clean cached
+ * frame is evicted by simply dropping it, since the file has a copy.
+ */
+#define PAGECACHE_BUCKETS    64
+struct pagecache_entry {
+	struct vnode *pc_vnode;
+	off_t pc_offset;	/* file offset of the first byte read */
+	vaddr_t pc_start;	/* bytes [pc_start, pc_end) of the page */
+	vaddr_t pc_end;		/* come from the file; the rest are 0 */
+	paddr_t pc_paddr;
+	struct pagecache_entry *pc_next;
+};
+#endif /* OPT_A3 */
+/*
+ * Wrap rma_stealmem in a spinlock.
+ */
+static struct spinlock stealmem_lock = SPINLOCK_INITIALIZER;
+#if OPT_A3
+/*
+ * Protects cm_refcount. User frames are shared copy-on-write between
+ * a parent and its forked children, so the count can change from
+ * several processes at once.
+ */
+static struct spinlock coremap_lock = SPINLOCK_INITIALIZER;
+
+/*
+ * Serializes page-table updates, eviction and swap I/O. Eviction
+ * rewrites another process's page table entry, so faults, as_copy
+ * and as_destroy take this too.
+ */
+static struct lock *vm_lock;
+static int clock_hand = 0;
+
+/*
+ * Address space IDs. Each address space is given the next free ID
+ * when it is activated; once all NUM_TLBPID-1 are used the generation
+ * is bumped, every address space has to get a new ID, and each cpu
+ * flushes its TLB the next time it activates one.
+ */
+static struct spinlock asid_lock = SPINLOCK_INITIALIZER;
+static uint32_t asid_generation = 1;
+static uint32_t asid_next = 1;
+
+static paddr_t zero_pool[ZERO_POOL_SIZE];
+static unsigned zero_pool_count = 0;
+static struct spinlock zero_pool_lock = SPINLOCK_INITIALIZER;
+
+/*
+ * TLB shootdown statistics, for shootdowns that had to reach another
+ * cpu. Latency is from queueing the first request to the last cpu
+ * finishing.
+ */
+static struct spinlock shootdown_stats_lock = SPINLOCK_INITIALIZER;
+static unsigned shootdown_count = 0;
+static unsigned shootdown_entries = 0;
+static uint64_t shootdown_total_ns = 0;
+static uint64_t shootdown_max_ns = 0;
+
+static struct pagecache_entry *pagecache[PAGECACHE_BUCKETS];
+static struct spinlock pagecache_lock = SPINLOCK_INITIALIZER;
+
+static void buddy_free_range(int idx, int npages);
+static paddr_t zero_pool_get(void);
+static void pagecache_remove(paddr_t paddr);
+#endif /* OPT_A3 */
+
+void
+vm_bootstrap(void)
+{
+	#if OPT_A3 
+	ram_getsize(&lo, &hi);
+	table_size = (hi - lo)/PAGE_SIZE;
+	int offset = (hi - lo)%PAGE_SIZE;
+	lo += offset;
+	if (hi - lo < table_size * sizeof(struct CoreEntry)) {
+		panic("No memory for core map");
+	}
+	core_map = (struct CoreEntry *)PADDR_TO_KVADDR(lo);
+	for (int i = 0; i < table_size; i++) {
+		if ((unsigned)i*PAGE_SIZE>=(unsigned)table_size * sizeof(struct CoreEntry)) {
+			core_map[i].cm_valid = 1;
+		} else {
+			core_map[i].cm_valid = 0;
+		}
+		core_map[i].cm_addr = lo + i * PAGE_SIZE;
+		core_map[i].cm_blocks = 0;
+		core_map[i].cm_refcount = 0;
+		core_map[i].cm_as = NULL;
+		core_map[i].cm_vaddr = 0;
+		core_map[i].cm_pte = NULL;
+		core_map[i].cm_referenced = 0;
+		core_map[i].cm_cache = NULL;
+		core_map[i].cm_dirty = 0;
+		core_map[i].cm_order = -1;
+		core_map[i].cm_next = -1;
+		core_map[i].cm_prev = -1;
+	}
+	for (int k = 0; k <= BUDDY_MAX_ORDER; k++) {
+		free_area[k] = -1;
+	}
+	frame_base = 0;
+	while (frame_base < table_size && !core_map[frame_base].cm_valid) {
+		frame_base++;
+	}
+	buddy_free_range(frame_base, table_size - frame_base);
+	stealMem = 0;
+	vmstats_init();
+
+	vm_lock = lock_create("vm");
+	if (vm_lock == NULL) {
+		panic("vm_bootstrap: could not create vm lock\n");
+	}
+	if (swap_bootstrap()) {
+		kprintf("vm: no swap device %s, paging disabled\n", SWAP_DEVICE);
+	}
+	#endif /* OPT_A3 */
+	/* Do nothing. */
+}
+
+#if OPT_A3
+static
+void
+buddy_push(int idx, int order)
+{
+	struct CoreEntry *ce = &core_map[idx];
+
+	ce->cm_order = order;
+	ce->cm_prev = -1;
+	ce->cm_next = free_area[order];
+	if (ce->cm_next >= 0) {
+		core_map[ce->cm_next].cm_prev = idx;
+	}
+	free_area[order] = idx;
+}
+
+static
+void
+buddy_remove(int idx)
+{
+	struct CoreEntry *ce = &core_map[idx];
+
+	if (ce->cm_prev >= 0) {
+		core_map[ce->cm_prev].cm_next = ce->cm_next;
+	} else {
+		free_area[ce->cm_order] = ce->cm_next;
+	}
+	if (ce->cm_next >= 0) {
+		core_map[ce->cm_next].cm_prev = ce->cm_prev;
+	}
+	ce->cm_order = -1;
+	ce->cm_next = ce->cm_prev = -1;
+}
+
+/*
+ * Free the 2^ORDER frames starting at IDX, merging with the buddy
+ * block for as long as it is free and of the same order.
+ */
+static
+void
+buddy_free_block(int idx, int order)
+{
+	int rel = idx - frame_base;
+	int buddy;
+
+	while (order < BUDDY_MAX_ORDER) {
+		buddy = rel ^ (1 << order);
+		if (buddy + (1 << order) > table_size - frame_base ||
+		    core_map[frame_base + buddy].cm_order != order) {
+			break;
+		}
+		buddy_remove(frame_base + buddy);
+		if (buddy < rel) {
+			rel = buddy;
+		}
+		order++;
+	}
+	buddy_push(frame_base + rel, order);
+}
+
+/*
+ * Free NPAGES frames starting at IDX. The run need not be a block, so
+ * it is carved into the largest aligned blocks that fit. Call with
+ * coremap_lock held.
+ */
+static
+void
+buddy_free_range(int idx, int npages)
+{
+	int rel, order;
+
+	for (int i = 0; i < npages; i++) {
+		core_map[idx + i].cm_valid = 1;
+	}
+	coremap_nfree += npages;
+
+	while (npages > 0) {
+		rel = idx - frame_base;
+		order = 0;
+		while (order < BUDDY_MAX_ORDER &&
+		       (rel & ((2 << order) - 1)) == 0 &&
+		       (2 << order) <= npages) {
+			order++;
+		}
+		buddy_free_block(idx, order);
+		idx += 1 << order;
+		npages -= 1 << order;
+	}
+}
+
+/*
+ * Take NPAGES contiguous frames from the smallest block that holds
+ * them, splitting off the unused halves; whatever is left over past
+ * NPAGES goes straight back. Returns 0 if no block is big enough.
+ * Call with coremap_lock held.
+ */
+static
+paddr_t
+buddy_alloc(unsigned long npages)
+{
+	int order, k, idx;
+
+	KASSERT(npages > 0);
+	order = 0;
+	while ((1UL << order) < npages) {
+		order++;
+	}
+	for (k = order; k <= BUDDY_MAX_ORDER; k++) {
+		if (free_area[k] >= 0) {
+			break;
+		}
+	}
+	if (k > BUDDY_MAX_ORDER) {
+		return 0;
+	}
+
+	idx = free_area[k];
+	buddy_remove(idx);
+	while (k > order) {
+		k--;
+		buddy_push(idx + (1 << k), k);
+	}
+
+	for (int i = 0; i < (int)npages; i++) {
+		core_map[idx + i].cm_valid = 0;
+	}
+	coremap_nfree -= (1 << order);
+	if ((unsigned long)(1 << order) > npages) {
+		/* counts the tail back into coremap_nfree */
+		buddy_free_range(idx + npages, (1 << order) - npages);
+	}
+	core_map[idx].cm_blocks = npages;
+	core_map[idx].cm_refcount = 1;
+	return core_map[idx].cm_addr;
+}
+
+/*
+ * Per-cpu frame cache. Frames sitting in a cpu's magazine are
+ * allocated as far as the buddy lists and coremap_nfree are
+ * concerned; each refill or drain moves CPU_FRAME_BATCH of them under
+ * one acquisition of coremap_lock. Interrupts are kept off while the
+ * magazine is touched so the thread cannot be switched out partway.
+ */
+static
+paddr_t
+frame_cache_get(void)
+{
+	struct cpu *c;
+	paddr_t pa;
+	int spl;
+
+	spl = splhigh();
+	c = curcpu->c_self;
+	if (c->c_nframes > 0) {
+		c->c_frame_allochits++;
+	} else {
+		c->c_frame_allocmisses++;
+		spinlock_acquire(&coremap_lock);
+		while (c->c_nframes < CPU_FRAME_BATCH) {
+			pa = buddy_alloc(1);
+			if (pa == 0) {
+				break;
+			}
+			c->c_frames[c->c_nframes++] = pa;
+		}
+		spinlock_release(&coremap_lock);
+		if (c->c_nframes == 0) {
+			splx(spl);
+			return 0;
+		}
+	}
+	pa = c->c_frames[--c->c_nframes];
+	splx(spl);
+
+	core_map[(pa - lo) / PAGE_SIZE].cm_blocks = 1;
+	core_map[(pa - lo) / PAGE_SIZE].cm_refcount = 1;
+	return pa;
+}
+
+/*
+ * Return the frames cached on C to the buddy lists, down to KEEP.
+ */
+static
+void
+frame_cache_drain(struct cpu *c, unsigned keep)
+{
+	paddr_t pa;
+
+	spinlock_acquire(&coremap_lock);
+	while (c->c_nframes > keep) {
+		pa = c->c_frames[--c->c_nframes];
+		buddy_free_range((pa - lo) / PAGE_SIZE, 1);
+	}
+	spinlock_release(&coremap_lock);
+}
+
+static
+void
+frame_cache_put(paddr_t pa)
+{
+	struct cpu *c;
+	int spl;
+
+	spl = splhigh();
+	c = curcpu->c_self;
+	if (c->c_nframes < CPU_FRAME_MAG) {
+		c->c_frame_freehits++;
+	} else {
+		c->c_frame_freemisses++;
+		frame_cache_drain(c, CPU_FRAME_MAG - CPU_FRAME_BATCH);
+	}
+	c->c_frames[c->c_nframes++] = pa;
+	splx(spl);
+}
+
+/*
+ * Free frames, counting those parked in the per-cpu magazines. The
+ * magazines are read without locking, so this is only a snapshot,
+ * which is all the reserve checks need.
+ */
+static
+unsigned
+vm_nfree(void)
+{
+	unsigned i, nfree;
+
+	nfree = coremap_nfree;
+	for (i = 0; i < cpu_count(); i++) {
+		nfree += cpu_get(i)->c_nframes;
+	}
+	return nfree;
+}
+
+void
+vm_printframestats(void)
+{
+	struct cpu *c;
+	unsigned i, allocs, frees;
+
+	kprintf("Per-cpu frame cache (%d frames free in buddy lists):\n",
+		coremap_nfree);
+	for (i = 0; i < cpu_count(); i++) {
+		c = cpu_get(i);
+		allocs = c->c_frame_allochits + c->c_frame_allocmisses;
+		frees = c->c_frame_freehits + c->c_frame_freemisses;
+		kprintf("  cpu%u: %u cached, alloc %u/%u hits (%u%%), "
+			"free %u/%u hits (%u%%)\n", c->c_number, c->c_nframes,
+			c->c_frame_allochits, allocs,
+			allocs ? c->c_frame_allochits * 100 / allocs : 0,
+			c->c_frame_freehits, frees,
+			frees ? c->c_frame_freehits * 100 / frees : 0);
+	}
+}
 #endif /* OPT_A3 */
+
+static
+paddr_t
+getppages(unsigned long npages)
+{
+	paddr_t addr;
+
+	#if OPT_A3
+	if (stealMem) {
+		spinlock_acquire(&stealmem_lock);
+		addr = ram_stealmem(npages);
+		spinlock_release(&stealmem_lock);
+	} else if (npages == 1) {
+		addr = frame_cache_get();
+	} else {
+		spinlock_acquire(&coremap_lock);
+		addr = buddy_alloc(npages);
+		spinlock_release(&coremap_lock);
+		if (addr == 0) {
+			/* cached frames may be what is breaking up the run */
+			int spl = splhigh();
+			frame_cache_drain(curcpu->c_self, 0);
+			splx(spl);
+			spinlock_acquire(&coremap_lock);
+			addr = buddy_alloc(npages);
+			spinlock_release(&coremap_lock);
+		}
+	}
+	#else
+	spinlock_acquire(&stealmem_lock);
+	addr = ram_stealmem(npages);
+	spinlock_release(&stealmem_lock);
+	#endif /* OPT_A3 */
+	return addr;
+}
+
+/* Allocate/free some kernel-space virtual pages */
+vaddr_t 
+alloc_kpages(int npages)
+{
+	paddr_t pa;
+	pa = getppages(npages);
+	if (pa==0) {
+		return 0;
+	}
+	return PADDR_TO_KVADDR(pa);
+}
+
+void 
+free_kpages(vaddr_t addr)
+{
+	/* nothing - leak the memory. */
+	#if OPT_A3
+	paddr_t paddr = KVADDR_TO_PADDR(addr);
+	if (paddr < lo) {
+		/* stolen before vm_bootstrap; not ours to free */
+		return;
+	}
+	int idx = (paddr-lo)/PAGE_SIZE;
+	KASSERT(!core_map[idx].cm_valid);
+	KASSERT(core_map[idx].cm_cache == NULL);
+	core_map[idx].cm_as = NULL;
+	core_map[idx].cm_pte = NULL;
+	core_map[idx].cm_referenced = 0;
+	core_map[idx].cm_dirty = 0;
+	if (core_map[idx].cm_blocks == 1) {
+		frame_cache_put(paddr);
+		return;
+	}
+	spinlock_acquire(&coremap_lock);
+	buddy_free_range(idx, core_map[idx].cm_blocks);
+	spinlock_release(&coremap_lock);
+	#endif /* OPT_A3*/
+	(void)addr;
+}
+
+#if OPT_A3
+static
+struct CoreEntry *
+coremap_entry(paddr_t paddr)
+{
+	KASSERT(paddr >= lo && paddr < hi);
+	return &core_map[(paddr - lo) / PAGE_SIZE];
+}
+
+/*
+ * Reference counting for user frames. A frame comes out of getppages
+ * with one reference; as_copy adds one per child instead of copying,
+ * and the frame goes back to the free pool when the last address
+ * space mapping it lets go.
+ */
+static
+void
+vm_page_ref(paddr_t paddr)
+{
+	struct CoreEntry *ce = coremap_entry(paddr);
+
+	spinlock_acquire(&coremap_lock);
+	KASSERT(ce->cm_refcount > 0);
+	ce->cm_refcount++;
+	/* no longer has a single owner, so not evictable */
+	ce->cm_as = NULL;
+	ce->cm_pte = NULL;
+	spinlock_release(&coremap_lock);
+}
+
+static
+void
+vm_page_unref(paddr_t paddr)
+{
+	struct CoreEntry *ce = coremap_entry(paddr);
+	int refs;
+
+	spinlock_acquire(&coremap_lock);
+	KASSERT(ce->cm_refcount > 0);
+	refs = --ce->cm_refcount;
+	spinlock_release(&coremap_lock);
+	if (refs == 0) {
+		if (ce->cm_cache != NULL) {
+			pagecache_remove(paddr);
+		}
+		free_kpages(PADDR_TO_KVADDR(paddr));
+	}
+}
+
+static
+int
+vm_page_refcount(paddr_t paddr)
+{
+	struct CoreEntry *ce = coremap_entry(paddr);
+	int refs;
+
+	spinlock_acquire(&coremap_lock);
+	refs = ce->cm_refcount;
+	spinlock_release(&coremap_lock);
+	return refs;
+}
+
+/*
+ * Take PADDR out of the running for eviction: its mapping is about to
+ * go, but the caller still needs the contents.
+ */
+static
+void
+vm_page_disown(paddr_t paddr)
+{
+	struct CoreEntry *ce = coremap_entry(paddr);
+
+	spinlock_acquire(&coremap_lock);
+	ce->cm_as = NULL;
+	ce->cm_pte = NULL;
+	spinlock_release(&coremap_lock);
+}
+
+/*
+ * Record that AS maps PADDR at VADDR through *PTE. A frame with a
+ * single owner becomes a candidate for eviction; the referenced bit
+ * gives it a second chance on the next sweep of the clock.
+ */
+static
+void
+vm_page_claim(paddr_t paddr, struct addrspace *as, vaddr_t vaddr,
+	      paddr_t *pte)
+{
+	struct CoreEntry *ce = coremap_entry(paddr);
+
+	spinlock_acquire(&coremap_lock);
+	if (ce->cm_refcount == 1) {
+		ce->cm_as = as;
+		ce->cm_vaddr = vaddr;
+		ce->cm_pte = pte;
+	}
+	ce->cm_referenced = 1;
+	spinlock_release(&coremap_lock);
+}
+
+/*
+ * Point the processor back at the active address space's ID after
+ * tlb_read and friends have clobbered it. Call with interrupts off.
+ */
+static
+void
+vm_tlb_restore_pid(void)
+{
+	tlb_setpid(curcpu->c_tlbpid << TLBHI_PIDSHIFT);
+}
+
+/*
+ * Drop any translation for VADDR in AS. Entries are tagged with the
+ * ASID, so AS need not be the running address space; but it only
+ * has entries on this cpu if its ID is from the generation this
+ * cpu's TLB was last flushed for.
+ */
+static
+void
+vm_tlb_invalidate(struct addrspace *as, vaddr_t vaddr)
+{
+	uint32_t asid;
+	int i, spl;
+
+	spl = splhigh();
+	spinlock_acquire(&asid_lock);
+	asid = as->as_asidgen == curcpu->c_asidgen ? as->as_asid : 0;
+	spinlock_release(&asid_lock);
+	if (asid != 0) {
+		i = tlb_probe(vaddr | (asid << TLBHI_PIDSHIFT), 0);
+		if (i >= 0) {
+			tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+		}
+		vm_tlb_restore_pid();
+	}
+	splx(spl);
+}
+
+/*
+ * Drop every translation this cpu holds for AS.
+ */
+static
+void
+vm_tlb_flush_as(struct addrspace *as)
+{
+	uint32_t asid, ehi, elo;
+	int i, spl;
+
+	spl = splhigh();
+	spinlock_acquire(&asid_lock);
+	asid = as->as_asidgen == curcpu->c_asidgen ? as->as_asid : 0;
+	spinlock_release(&asid_lock);
+	if (asid != 0) {
+		for (i=0; i<NUM_TLB; i++) {
+			tlb_read(&ehi, &elo, i);
+			if ((elo & TLBLO_VALID) &&
+			    (ehi & TLBHI_PID) >> TLBHI_PIDSHIFT == asid) {
+				tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+			}
+		}
+		vm_tlb_restore_pid();
+		vmstats_inc(VMSTAT_TLB_INVALIDATE);
+	}
+	splx(spl);
+}
+
+/*
+ * Drop the translations for the N pages in VADDRS of AS everywhere,
+ * or every translation of AS if VADDRS is NULL. Only cpus that have
+ * run AS are asked, and all the requests for one cpu go out under a
+ * single IPI. Returns once every cpu has finished, so the caller may
+ * then reuse the frames.
+ */
+static
+void
+vm_tlb_shootdown(struct addrspace *as, const vaddr_t *vaddrs, unsigned n)
+{
+	struct tlbshootdown ts;
+	unsigned tickets[VM_MAXCPUS];
+	uint32_t mask;
+	time_t s0, s1;
+	uint32_t ns0, ns1;
+	uint64_t ns;
+	unsigned c, i;
+	int spl;
+
+	/* a target spinning on our spinlock could never take the IPI */
+	KASSERT(curthread->t_iplhigh_count == 0);
+
+	if (n > TLBSHOOTDOWN_MAX) {
+		vaddrs = NULL;
+	}
+	ts.ts_addrspace = as;
+
+	spl = splhigh();
+	if (vaddrs == NULL) {
+		vm_tlb_flush_as(as);
+	}
+	for (i = 0; vaddrs != NULL && i < n; i++) {
+		vm_tlb_invalidate(as, vaddrs[i]);
+	}
+	mask = as->as_cpumask & ~((uint32_t)1 << curcpu->c_number);
+	if (mask != 0) {
+		gettime(&s0, &ns0);
+	}
+	for (c = 0; c < cpu_count(); c++) {
+		if ((mask & ((uint32_t)1 << c)) == 0) {
+			continue;
+		}
+		if (vaddrs == NULL) {
+			ts.ts_vaddr = TLBSHOOTDOWN_ASALL;
+			tickets[c] = ipi_tlbshootdown(cpu_get(c), &ts);
+		}
+		for (i = 0; vaddrs != NULL && i < n; i++) {
+			ts.ts_vaddr = vaddrs[i];
+			tickets[c] = ipi_tlbshootdown(cpu_get(c), &ts);
+		}
+	}
+	splx(spl);
+
+	if (mask == 0) {
+		return;
+	}
+	for (c = 0; c < cpu_count(); c++) {
+		if (mask & ((uint32_t)1 << c)) {
+			ipi_tlbshootdown_wait(cpu_get(c), tickets[c]);
+		}
+	}
+	gettime(&s1, &ns1);
+	getinterval(s0, ns0, s1, ns1, &s1, &ns1);
+	ns = (uint64_t)s1 * 1000000000 + ns1;
+
+	spinlock_acquire(&shootdown_stats_lock);
+	shootdown_count++;
+	shootdown_entries += vaddrs == NULL ? 1 : n;
+	shootdown_total_ns += ns;
+	if (ns > shootdown_max_ns) {
+		shootdown_max_ns = ns;
+	}
+	spinlock_release(&shootdown_stats_lock);
+}
+
+/*
+ * Shoot down NPAGES pages of AS starting at BASE; a range too big to
+ * name page by page drops all of AS's translations instead.
+ */
+static
+void
+vm_tlb_shootdown_range(struct addrspace *as, vaddr_t base, size_t npages)
+{
+	vaddr_t vaddrs[TLBSHOOTDOWN_MAX];
+
+	if (npages > TLBSHOOTDOWN_MAX) {
+		vm_tlb_shootdown(as, NULL, 0);
+		return;
+	}
+	for (size_t i = 0; i < npages; i++) {
+		vaddrs[i] = base + i * PAGE_SIZE;
+	}
+	vm_tlb_shootdown(as, vaddrs, npages);
+}
+
+void
+vm_printtlbstats(void)
+{
+	unsigned i, ipis = 0;
+
+	for (i = 0; i < cpu_count(); i++) {
+		ipis += cpu_get(i)->c_shootdown_ipis;
+	}
+	spinlock_acquire(&shootdown_stats_lock);
+	kprintf("TLB shootdowns: %u (%u entries, %u IPIs), "
+		"latency avg %u us, max %u us\n",
+		shootdown_count, shootdown_entries, ipis,
+		shootdown_count ?
+		(unsigned)(shootdown_total_ns / shootdown_count / 1000) : 0,
+		(unsigned)(shootdown_max_ns / 1000));
+	spinlock_release(&shootdown_stats_lock);
+}
+
+/*
+ * Page out one user frame, chosen by second-chance clock: frames
+ * referenced since the last sweep get their bit cleared (and their
+ * translation dropped, so the next use sets it again) and are passed
+ * over once. Call with vm_lock held.
+ */
+static
+int
+vm_evict(void)
+{
+	struct CoreEntry *ce = NULL;
+	struct addrspace *as;
+	paddr_t *pte;
+	vaddr_t va;
+	unsigned slot;
+	int n, result;
+
+	KASSERT(lock_do_i_hold(vm_lock));
+
+	/* no point sweeping if there is nowhere to put the page */
+	result = swap_alloc(&slot);
+	if (result) {
+		return result;
+	}
+
+	spinlock_acquire(&coremap_lock);
+	for (n = 0; n < 2 * table_size; n++) {
+		ce = &core_map[clock_hand];
+		clock_hand = (clock_hand + 1) % table_size;
+		if (ce->cm_valid || ce->cm_pte == NULL) {
+			continue;
+		}
+		if (ce->cm_cache != NULL && ce->cm_dirty) {
+			/* only the last unmap may write it back */
+			continue;
+		}
+		if (ce->cm_referenced) {
+			/*
+			 * Only a hint, so other cpus are not asked; we
+			 * hold a spinlock and could not wait for them.
+			 */
+			ce->cm_referenced = 0;
+			vm_tlb_invalidate(ce->cm_as, ce->cm_vaddr);
+			continue;
+		}
+		break;
+	}
+	spinlock_release(&coremap_lock);
+	if (n == 2 * table_size) {
+		/* everything is kernel memory or shared */
+		swap_free(slot);
+		return ENOMEM;
+	}
+
+	pte = ce->cm_pte;
+	as = ce->cm_as;
+	va = ce->cm_vaddr;
+	KASSERT(*pte == ce->cm_addr);
+	if (ce->cm_cache != NULL) {
+		/* clean file page: the next fault reads it again */
+		*pte = 0;
+		vm_tlb_shootdown(as, &va, 1);
+		swap_free(slot);
+		vm_page_unref(ce->cm_addr);
+		return 0;
+	}
+
+	/* The owner faults on vm_lock until the write is done. */
+	*pte = PTE_MKSWAP(slot);
+	vm_tlb_shootdown(as, &va, 1);
+
+	result = swap_out(ce->cm_addr, slot);
+	if (result) {
+		*pte = ce->cm_addr;
+		swap_free(slot);
+		return result;
+	}
+	vm_page_unref(ce->cm_addr);
+	return 0;
+}
+
+/*
+ * Get a frame for a user page, evicting if memory is short. Call with
+ * vm_lock held.
+ */
+static
+paddr_t
+vm_alloc_upage(void)
+{
+	paddr_t paddr;
+
+	KASSERT(lock_do_i_hold(vm_lock));
+
+	while (vm_nfree() < VM_RESERVE_PAGES) {
+		if (vm_evict()) {
+			break;
+		}
+	}
+	paddr = getppages(1);
+	while (paddr == 0 && vm_evict() == 0) {
+		paddr = getppages(1);
+	}
+	if (paddr == 0) {
+		/* last resort; the zeroing is wasted but the frame is not */
+		paddr = zero_pool_get();
+	}
+	return paddr;
+}
+
+/*
+ * Take a frame from the pre-zeroed pool, or return 0 if it is empty.
+ */
+static
+paddr_t
+zero_pool_get(void)
+{
+	paddr_t paddr = 0;
+
+	spinlock_acquire(&zero_pool_lock);
+	if (zero_pool_count > 0) {
+		paddr = zero_pool[--zero_pool_count];
+	}
+	spinlock_release(&zero_pool_lock);
+	return paddr;
+}
+
+/*
+ * Get a zero-filled frame for a user page, preferably one zeroed
+ * earlier by an idle cpu. Call with vm_lock held.
+ */
+static
+paddr_t
+vm_alloc_zpage(void)
+{
+	paddr_t paddr;
+
+	paddr = zero_pool_get();
+	if (paddr != 0) {
+		vmstats_inc(VMSTAT_ZERO_POOL_HIT);
+		return paddr;
+	}
+	paddr = vm_alloc_upage();
+	if (paddr != 0) {
+		bzero((void *)PADDR_TO_KVADDR(paddr), PAGE_SIZE);
+		vmstats_inc(VMSTAT_ZERO_POOL_MISS);
+	}
+	return paddr;
+}
+
+/*
+ * Called from the idle loop with interrupts off. Zero at most one
+ * frame per call so that a wakeup is not held up for long.
+ */
+void
+vm_zero_idle(void)
+{
+	paddr_t paddr;
+	bool full;
+
+	if (stealMem || vm_nfree() < ZERO_POOL_MINFREE) {
+		return;
+	}
+	spinlock_acquire(&zero_pool_lock);
+	full = zero_pool_count == ZERO_POOL_SIZE;
+	spinlock_release(&zero_pool_lock);
+	if (full) {
+		return;
+	}
+
+	paddr = getppages(1);
+	if (paddr == 0) {
+		return;
+	}
+	bzero((void *)PADDR_TO_KVADDR(paddr), PAGE_SIZE);
+
+	spinlock_acquire(&zero_pool_lock);
+	if (zero_pool_count < ZERO_POOL_SIZE) {
+		zero_pool[zero_pool_count++] = paddr;
+		paddr = 0;
+	}
+	spinlock_release(&zero_pool_lock);
+	if (paddr != 0) {
+		/* another cpu filled the last slot */
+		free_kpages(PADDR_TO_KVADDR(paddr));
+	}
+}
+
+/*
+ * Give the caller a private copy of the frame in *PTE, breaking the
+ * copy-on-write sharing set up by as_copy. If we are already the only
+ * user of the frame there is nothing to copy.
+ */
+static
+int
+vm_cow_break(struct addrspace *as, vaddr_t va, paddr_t *pte)
+{
+	paddr_t old = *pte;
+	paddr_t new;
+
+	if (vm_page_refcount(old) == 1) {
+		return 0;
+	}
+	new = vm_alloc_upage();
+	if (new == 0) {
+		return ENOMEM;
+	}
+	memmove((void *)PADDR_TO_KVADDR(new),
+		(const void *)PADDR_TO_KVADDR(old), PAGE_SIZE);
+	*pte = new;
+	/* no cpu may keep writing to the frame we are letting go of */
+	vm_tlb_shootdown(as, &va, 1);
+	/* someone else may have broken their share meanwhile */
+	vm_page_unref(old);
+	return 0;
+}
+
+static
+unsigned
+pagecache_hash(struct vnode *v, off_t offset)
+{
+	return ((uintptr_t)v / sizeof(void *) + (unsigned)(offset / PAGE_SIZE))
+		% PAGECACHE_BUCKETS;
+}
+
+/*
+ * Look for a cached frame holding the same file bytes at the same
+ * place in the page. If there is one, take a reference on it for the
+ * caller and return it; otherwise return 0. Call with vm_lock held.
+ */
+static
+paddr_t
+pagecache_lookup(struct vnode *v, off_t offset, vaddr_t start, vaddr_t end)
+{
+	struct pagecache_entry *pc;
+	paddr_t paddr = 0;
+
+	KASSERT(lock_do_i_hold(vm_lock));
+	spinlock_acquire(&pagecache_lock);
+	for (pc = pagecache[pagecache_hash(v, offset)]; pc != NULL;
+	     pc = pc->pc_next) {
+		if (pc->pc_vnode == v && pc->pc_offset == offset &&
+		    pc->pc_start == start && pc->pc_end == end) {
+			paddr = pc->pc_paddr;
+			break;
+		}
+	}
+	if (paddr != 0) {
+		/* vm_lock keeps the last mapping from going away */
+		vm_page_ref(paddr);
+	}
+	spinlock_release(&pagecache_lock);
+	return paddr;
+}
+
+/*
+ * Enter a freshly read frame into the cache. For a text page,
+ * failing to get memory for the entry only means the page is not
+ * shared, but a MAP_SHARED page must be found by every mapper, so the
+ * error is returned.
+ */
+static
+int
+pagecache_insert(struct vnode *v, off_t offset, vaddr_t start, vaddr_t end,
+		 paddr_t paddr)
+{
+	struct pagecache_entry *pc;
+	unsigned h = pagecache_hash(v, offset);
+
+	pc = kmalloc(sizeof(*pc));
+	if (pc == NULL) {
+		return ENOMEM;
+	}
+	pc->pc_vnode = v;
+	pc->pc_offset = offset;
+	pc->pc_start = start;
+	pc->pc_end = end;
+	pc->pc_paddr = paddr;
+
+	spinlock_acquire(&pagecache_lock);
+	pc->pc_next = pagecache[h];
+	pagecache[h] = pc;
+	coremap_entry(paddr)->cm_cache = pc;
+	spinlock_release(&pagecache_lock);
+	return 0;
+}
+
+/*
+ * Drop the cache entry for a frame whose last mapping has gone. The
+ * coremap points at the entry, so only its own bucket is searched.
+ */
+static
+void
+pagecache_remove(paddr_t paddr)
+{
+	struct CoreEntry *ce = coremap_entry(paddr);
+	struct pagecache_entry *pc, **pp;
+
+	spinlock_acquire(&pagecache_lock);
+	pc = ce->cm_cache;
+	KASSERT(pc != NULL);
+	KASSERT(pc->pc_paddr == paddr);
+	pp = &pagecache[pagecache_hash(pc->pc_vnode, pc->pc_offset)];
+	while (*pp != pc) {
+		KASSERT(*pp != NULL);
+		pp = &(*pp)->pc_next;
+	}
+	*pp = pc->pc_next;
+	ce->cm_cache = NULL;
+	spinlock_release(&pagecache_lock);
+	kfree(pc);
+}
+
+/*
+ * Bring in a page of region R that has never been touched: read
+ * whatever part of it lies within the region's file image from the
+ * file and zero the rest. If SHARED is set the page comes from, and
+ * goes into, the page cache: either it will never be written, or R is
+ * a MAP_SHARED mapping, whose pages are always read whole so that
+ * every mapper of the file can use the same frame.
+ *
+ * A mapped file may have shrunk since it was mapped; what lies past
+ * its end now reads as zeros. A short read of a program segment means
+ * the executable is damaged.
+ */
+static
+int
+vm_page_load(struct vm_region *r, paddr_t *pte, vaddr_t va, bool shared)
+{
+	vaddr_t fileva = r->vr_fileva;
+	size_t filesz = r->vr_filesz;
+	struct iovec iov;
+	struct uio u;
+	paddr_t paddr, cached;
+	vaddr_t start, end;
+	off_t offset;
+	char *kva;
+	int result;
+
+	start = va > fileva ? va : fileva;
+	end = va + PAGE_SIZE < fileva + filesz ? va + PAGE_SIZE : fileva + filesz;
+	if (r->vr_shared) {
+		start = va;
+		end = va + PAGE_SIZE;
+	}
+	if (r->vr_vnode == NULL || start >= end) {
+		paddr = vm_alloc_zpage();
+		if (paddr == 0) {
+			return ENOMEM;
+		}
+		vmstats_inc(VMSTAT_PAGE_FAULT_ZERO);
+	}
+	else {
+		offset = r->vr_offset + (start - fileva);
+		if (shared) {
+			paddr = pagecache_lookup(r->vr_vnode, offset,
+						 start - va, end - va);
+			if (paddr != 0) {
+				/* no I/O; counted as a reload for vmstats */
+				vmstats_inc(VMSTAT_TLB_RELOAD);
+				vmstats_inc(VMSTAT_PAGECACHE_HIT);
+				*pte = paddr;
+				return 0;
+			}
+		}
+		paddr = vm_alloc_upage();
+		if (paddr == 0) {
+			return ENOMEM;
+		}
+		kva = (char *)PADDR_TO_KVADDR(paddr);
+		bzero(kva, start - va);
+		bzero(kva + (end - va), va + PAGE_SIZE - end);
+		uio_kinit(&iov, &u, kva + (start - va), end - start,
+			  offset, UIO_READ);
+		/*
+		 * Don't hold vm_lock across file system I/O: a thread
+		 * holding a file system lock may fault on a user buffer.
+		 * The frame has no owner yet, so it cannot be evicted
+		 * from under us.
+		 */
+		lock_release(vm_lock);
+		result = VOP_READ(r->vr_vnode, &u);
+		lock_acquire(vm_lock);
+		if (result == 0 && u.uio_resid != 0) {
+			if (r->vr_mmapped) {
+				bzero(kva + (end - va) - u.uio_resid,
+				      u.uio_resid);
+			}
+			else {
+				kprintf("ELF: short read on segment - "
+					"file truncated?\n");
+				result = ENOEXEC;
+			}
+		}
+		if (result) {
+			free_kpages(PADDR_TO_KVADDR(paddr));
+			return result;
+		}
+		vmstats_inc(VMSTAT_PAGE_FAULT_DISK);
+		vmstats_inc(VMSTAT_ELF_FILE_READ);
+		if (shared) {
+			/* another process may have read it meanwhile */
+			cached = pagecache_lookup(r->vr_vnode, offset,
+						  start - va, end - va);
+			if (cached != 0) {
+				free_kpages(PADDR_TO_KVADDR(paddr));
+				paddr = cached;
+			}
+			else {
+				result = pagecache_insert(r->vr_vnode, offset,
+							  start - va, end - va,
+							  paddr);
+				if (result && r->vr_shared) {
+					free_kpages(PADDR_TO_KVADDR(paddr));
+					return result;
+				}
+			}
+		}
+	}
+	*pte = paddr;
+	return 0;
+}
+
 /*
- * Wrap rma_stealmem in a spinlock.
+ * Read swap slot SLOT into the frame at PADDR. Every read counts as a
+ * swap file read; reads that do not serve a page fault (fork, munmap)
+ * are also counted apart, so the page fault totals still add up.
  */
-static struct spinlock stealmem_lock = SPINLOCK_INITIALIZER;
+static
+int
+vm_swap_read(paddr_t paddr, unsigned slot, bool fault)
+{
+	int result;
 
-void
-vm_bootstrap(void)
+	result = swap_in(paddr, slot);
+	if (result) {
+		return result;
+	}
+	vmstats_inc(VMSTAT_SWAP_FILE_READ);
+	if (fault) {
+		vmstats_inc(VMSTAT_PAGE_FAULT_DISK);
+	}
+	else {
+		vmstats_inc(VMSTAT_SWAP_NOFAULT_READ);
+	}
+	return 0;
+}
+
+/*
+ * Bring a page back in from swap.
+ */
+static
+int
+vm_page_swapin(paddr_t *pte)
 {
-	#if OPT_A3 
-	ram_getsize(&lo, &hi);
-	table_size = (hi - lo)/PAGE_SIZE;
-	int offset = (hi - lo)%PAGE_SIZE;
-	lo += offset;
-	if (hi - lo < table_size * sizeof(struct CoreEntry)) {
-		panic("No memory for core map");
+	unsigned slot = PTE_SLOT(*pte);
+	paddr_t paddr;
+	int result;
+
+	paddr = vm_alloc_upage();
+	if (paddr == 0) {
+		return ENOMEM;
 	}
-	core_map = (struct CoreEntry *)PADDR_TO_KVADDR(lo);
-	for (int i = 0; i < table_size; i++) {
-		if ((unsigned)i*PAGE_SIZE>=(unsigned)table_size * sizeof(struct CoreEntry)) {
-			core_map[i].cm_valid = 1;
-		} else {
-			core_map[i].cm_valid = 0;
+	result = vm_swap_read(paddr, slot, true);
+	if (result) {
+		free_kpages(PADDR_TO_KVADDR(paddr));
+		return result;
+	}
+	swap_free(slot);
+	*pte = paddr;
+	return 0;
+}
+
+/*
+ * Find the page table entry for VA in AS. If the second-level table
+ * does not exist yet it is allocated when CREATE is set; otherwise,
+ * or if there is no memory for it, NULL is returned. Call with
+ * vm_lock held.
+ */
+static
+paddr_t *
+pt_lookup(struct addrspace *as, vaddr_t va, bool create)
+{
+	paddr_t *l2;
+
+	KASSERT(lock_do_i_hold(vm_lock));
+	KASSERT(va < USERSPACETOP);
+
+	l2 = as->as_pagetable[PT_L1_INDEX(va)];
+	if (l2 == NULL) {
+		if (!create) {
+			return NULL;
 		}
-		core_map[i].cm_addr = lo + i * PAGE_SIZE;
-		core_map[i].cm_blocks = 0;
+		l2 = kmalloc(PT_L2_SIZE * sizeof(paddr_t));
+		if (l2 == NULL) {
+			return NULL;
+		}
+		bzero(l2, PT_L2_SIZE * sizeof(paddr_t));
+		as->as_pagetable[PT_L1_INDEX(va)] = l2;
 	}
-	stealMem = 0;
-	#endif /* OPT_A3 */
-	/* Do nothing. */
+	return &l2[PT_L2_INDEX(va)];
 }
 
+/*
+ * Release every page in AS's page table, resident or swapped, and the
+ * table itself. Call with vm_lock held.
+ */
 static
-paddr_t
-getppages(unsigned long npages)
+void
+pt_destroy(struct addrspace *as)
 {
-	paddr_t addr;
+	paddr_t *l2;
 
-	#if OPT_A3
-	if (stealMem) {
-		spinlock_acquire(&stealmem_lock);
-		addr = ram_stealmem(npages);
-		spinlock_release(&stealmem_lock);
-	} else {
-		int page_count = 0;
-		for (int i = 0; i < table_size; i++) {
-			if (core_map[i].cm_valid) {
-				page_count++;
-				if (page_count == (int)npages) {
-					for (int j = 0;j < (int)npages; j++) {
-						core_map[i-(int)j].cm_valid = 0;
-					}
-					core_map[i+1-npages].cm_blocks = npages;
-					addr = core_map[i+1-npages].cm_addr;
-					break;
-				} 
-			} else {
-				page_count = 0;
+	if (as->as_pagetable == NULL) {
+		return;
+	}
+	for (unsigned i = 0; i < PT_L1_SIZE; i++) {
+		l2 = as->as_pagetable[i];
+		if (l2 == NULL) {
+			continue;
+		}
+		for (unsigned j = 0; j < PT_L2_SIZE; j++) {
+			if (l2[j] == 0) {
+				continue;
+			}
+			if (PTE_IS_SWAPPED(l2[j])) {
+				swap_free(PTE_SLOT(l2[j]));
+			}
+			else {
+				/* may still be shared with a parent or child */
+				vm_page_unref(l2[j]);
 			}
-		} if (page_count < (int)npages) {
-			return ENOMEM;
 		}
+		kfree(l2);
 	}
-	#else
-	spinlock_acquire(&stealmem_lock);
-	addr = ram_stealmem(npages);
-	spinlock_release(&stealmem_lock);
-	#endif /* OPT_A3 */
-	return addr;
+	kfree(as->as_pagetable);
+	as->as_pagetable = NULL;
 }
 
-/* Allocate/free some kernel-space virtual pages */
-vaddr_t 
-alloc_kpages(int npages)
+/*
+ * Region lists. Regions are kept sorted and never overlap; vm_fault
+ * checks the last region it hit before walking the list.
+ */
+static
+struct vm_region *
+as_find_region(struct addrspace *as, vaddr_t va)
 {
-	paddr_t pa;
-	pa = getppages(npages);
-	if (pa==0) {
-		return 0;
+	struct vm_region *r = as->as_lastregion;
+
+	if (r != NULL && va >= r->vr_base &&
+	    va - r->vr_base < r->vr_npages * PAGE_SIZE) {
+		return r;
 	}
-	return PADDR_TO_KVADDR(pa);
+	for (r = as->as_regions; r != NULL && r->vr_base <= va; r = r->vr_next) {
+		if (va - r->vr_base < r->vr_npages * PAGE_SIZE) {
+			as->as_lastregion = r;
+			return r;
+		}
+	}
+	return NULL;
 }
 
-void 
-free_kpages(vaddr_t addr)
+/*
+ * Add an anonymous region of NPAGES pages at BASE to AS, keeping the
+ * GUARD pages below it clear of other regions.
+ */
+static
+int
+as_add_region(struct addrspace *as, vaddr_t base, size_t npages,
+	      size_t guard, int readable, int writeable, int executable,
+	      struct vm_region **ret)
 {
-	/* nothing - leak the memory. */
-	#if OPT_A3
-	int paddr = KVADDR_TO_PADDR(addr);
-	int idx = (paddr-lo)/PAGE_SIZE;
-	int npages = core_map[idx].cm_blocks;
-	for (int i = 0; i < npages; i++) {
-		core_map[i+idx].cm_valid = 1;
+	struct vm_region *r, **pp;
+	vaddr_t top = base + npages * PAGE_SIZE;
+	vaddr_t bottom;
+
+	KASSERT((base & PAGE_FRAME) == base);
+	if (guard * PAGE_SIZE > base) {
+		return EINVAL;
 	}
-	#endif /* OPT_A3*/
-	(void)addr;
+	bottom = base - guard * PAGE_SIZE;
+
+	for (pp = &as->as_regions; *pp != NULL; pp = &(*pp)->vr_next) {
+		if ((*pp)->vr_base - (*pp)->vr_guard * PAGE_SIZE >= top) {
+			break;
+		}
+		if ((*pp)->vr_base + (*pp)->vr_npages * PAGE_SIZE > bottom) {
+			kprintf("dumbvm: region at 0x%x overlaps 0x%x\n",
+				base, (*pp)->vr_base);
+			return EINVAL;
+		}
+	}
+
+	r = kmalloc(sizeof(*r));
+	if (r == NULL) {
+		return ENOMEM;
+	}
+	r->vr_base = base;
+	r->vr_npages = npages;
+	r->vr_readable = readable != 0;
+	r->vr_writeable = writeable != 0;
+	r->vr_executable = executable != 0;
+	r->vr_guard = guard;
+	r->vr_mmapped = 0;
+	r->vr_shared = 0;
+	r->vr_vnode = NULL;
+	r->vr_fileva = base;
+	r->vr_offset = 0;
+	r->vr_filesz = 0;
+	r->vr_next = *pp;
+	*pp = r;
+	*ret = r;
+	return 0;
+}
+
+static
+void
+as_free_regions(struct addrspace *as)
+{
+	struct vm_region *r;
+
+	while (as->as_regions != NULL) {
+		r = as->as_regions;
+		as->as_regions = r->vr_next;
+		if (r->vr_vnode != NULL) {
+			/* regions only hold a reference, not an open */
+			VOP_DECREF(r->vr_vnode);
+		}
+		kfree(r);
+	}
+	as->as_lastregion = NULL;
+}
+
+/*
+ * Load a translation for the active address space, replacing any
+ * existing entry for the same page (there must never be two).
+ * Otherwise a slot is picked by a clock over the TLB: the hand stops
+ * at the first invalid slot, or at the first valid one whose
+ * software referenced bit is clear, clearing the bits it passes.
+ * Entries installed for a real miss (DEMAND) start out referenced;
+ * those preloaded by fault-around do not, so they go first if they
+ * were never needed. Call with interrupts off.
+ */
+static
+void
+vm_tlb_install(vaddr_t vaddr, uint32_t elo, bool demand)
+{
+	struct cpu *c = curcpu->c_self;
+	uint32_t ehi, oldhi, oldlo;
+	uint64_t bit;
+	int i, n;
+
+	ehi = vaddr | (c->c_tlbpid << TLBHI_PIDSHIFT);
+	i = tlb_probe(ehi, 0);
+	if (i >= 0) {
+		tlb_write(ehi, elo, i);
+		if (demand) {
+			c->c_tlbref |= (uint64_t)1 << i;
+		}
+		return;
+	}
+	for (n = 0; n < 2 * NUM_TLB; n++) {
+		i = c->c_tlbhand;
+		c->c_tlbhand = (c->c_tlbhand + 1) % NUM_TLB;
+		bit = (uint64_t)1 << i;
+		tlb_read(&oldhi, &oldlo, i);
+		if ((oldlo & TLBLO_VALID) && (c->c_tlbref & bit)) {
+			c->c_tlbref &= ~bit;
+			continue;
+		}
+		break;
+	}
+	tlb_write(ehi, elo, i);
+	if (demand) {
+		c->c_tlbref |= bit;
+		vmstats_inc((oldlo & TLBLO_VALID) ?
+			    VMSTAT_TLB_FAULT_REPLACE : VMSTAT_TLB_FAULT_FREE);
+	}
+	else {
+		c->c_tlbref &= ~bit;
+		vmstats_inc(VMSTAT_TLB_PRELOAD);
+	}
+}
+
+#if VM_FAULTAROUND > 0
+/*
+ * Fault-around: after a miss at VA in region R, map the next few
+ * pages of R that are already resident, so that a sequential sweep
+ * takes one trap per VM_FAULTAROUND+1 pages. Pages that are not in
+ * memory are left for a real fault. Call with vm_lock held and
+ * interrupts off.
+ */
+static
+void
+vm_fault_around(struct addrspace *as, struct vm_region *r, vaddr_t va,
+		bool writeable)
+{
+	vaddr_t top = r->vr_base + r->vr_npages * PAGE_SIZE;
+	paddr_t *pte;
+	uint32_t elo;
+
+	for (int k = 0; k < VM_FAULTAROUND; k++) {
+		va += PAGE_SIZE;
+		if (va >= top) {
+			break;
+		}
+		pte = pt_lookup(as, va, false);
+		if (pte == NULL || *pte == 0 || PTE_IS_SWAPPED(*pte)) {
+			continue;
+		}
+		if (tlb_probe(va | (curcpu->c_tlbpid << TLBHI_PIDSHIFT), 0) >= 0) {
+			continue;
+		}
+		/* same rules as the faulting page; shared pages stay clean */
+		elo = *pte | TLBLO_VALID;
+		if (writeable && !r->vr_shared &&
+		    vm_page_refcount(*pte) == 1) {
+			elo |= TLBLO_DIRTY;
+		}
+		vm_tlb_install(va, elo, false);
+	}
+}
+#endif /* VM_FAULTAROUND */
+
+/*
+ * Throw away all translations on this CPU. Call with interrupts off.
+ */
+static
+void
+vm_tlb_flush(void)
+{
+	int i;
+
+	for (i=0; i<NUM_TLB; i++) {
+		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+	}
+	vm_tlb_restore_pid();
+	vmstats_inc(VMSTAT_TLB_INVALIDATE);
 }
 
+#endif /* OPT_A3 */
+
+/*
+ * Shootdown requests from other cpus; called from the IPI handler
+ * with interrupts off.
+ */
 void
 vm_tlbshootdown_all(void)
 {
+	#if OPT_A3
+	vm_tlb_flush();
+	#else
 	panic("dumbvm tried to do tlb shootdown?!\n");
+	#endif /* OPT_A3 */
 }
 
 void
 vm_tlbshootdown(const struct tlbshootdown *ts)
 {
+	#if OPT_A3
+	if (ts->ts_vaddr == TLBSHOOTDOWN_ASALL) {
+		vm_tlb_flush_as(ts->ts_addrspace);
+	}
+	else {
+		vm_tlb_invalidate(ts->ts_addrspace, ts->ts_vaddr);
+	}
+	#else
 	(void)ts;
 	panic("dumbvm tried to do tlb shootdown?!\n");
+	#endif /* OPT_A3 */
 }
 
 int
 vm_fault(int faulttype, vaddr_t faultaddress)
 {
-	vaddr_t vbase1, vtop1, vbase2, vtop2, stackbase, stacktop;
 	paddr_t paddr;
+	#if OPT_A3
+	struct vm_region *region;
+	paddr_t *pte;
+	bool writeable;
+	int result;
+	uint32_t elo;
+	#else
+	vaddr_t vbase1, vtop1, vbase2, vtop2, stackbase, stacktop;
 	int i;
 	uint32_t ehi, elo;
+	#endif /* OPT_A3 */
 	struct addrspace *as;
 	int spl;
 
@@ -186,8 +1673,13 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 
 	switch (faulttype) {
 	    case VM_FAULT_READONLY:
+		#if OPT_A3
+		/* Write to a copy-on-write page, or to the text segment */
+		break;
+		#else
 		/* We always create pages read-write, so we can't get this */
 		panic("dumbvm: got VM_FAULT_READONLY\n");
+		#endif /* OPT_A3 */
 	    case VM_FAULT_READ:
 	    case VM_FAULT_WRITE:
 		break;
@@ -213,9 +1705,59 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 		return EFAULT;
 	}
 
-	/* Assert that the address space has been set up properly. */
 	#if OPT_A3
-	#else 
+	if (faultaddress >= USERSPACETOP) {
+		return EFAULT;
+	}
+	region = as_find_region(as, faultaddress);
+	if (region == NULL) {
+		return EFAULT;
+	}
+
+	/* Read-only regions become read-only once they have been loaded */
+	writeable = !as->as_loaded || region->vr_writeable;
+	if (faulttype == VM_FAULT_READONLY && !writeable) {
+		return EFAULT;
+	}
+	if (faulttype != VM_FAULT_READONLY) {
+		vmstats_inc(VMSTAT_TLB_FAULT);
+	}
+
+	lock_acquire(vm_lock);
+	pte = pt_lookup(as, faultaddress, true);
+	if (pte == NULL) {
+		lock_release(vm_lock);
+		return ENOMEM;
+	}
+	if (*pte == 0) {
+		/* first touch: read it from the file or zero it */
+		result = vm_page_load(region, pte, faultaddress,
+				      (!writeable && !region->vr_mmapped) ||
+				      region->vr_shared);
+	}
+	else if (PTE_IS_SWAPPED(*pte)) {
+		/* MAP_SHARED pages are dropped, never swapped */
+		KASSERT(!region->vr_shared);
+		result = vm_page_swapin(pte);
+	}
+	else {
+		if (faulttype != VM_FAULT_READONLY) {
+			vmstats_inc(VMSTAT_TLB_RELOAD);
+		}
+		result = 0;
+	}
+	if (result == 0 && faulttype != VM_FAULT_READ && writeable &&
+	    !region->vr_shared) {
+		result = vm_cow_break(as, faultaddress, pte);
+	}
+	if (result) {
+		lock_release(vm_lock);
+		return result;
+	}
+	paddr = *pte;
+	vm_page_claim(paddr, as, faultaddress, pte);
+	#else
+	/* Assert that the address space has been set up properly. */
 	KASSERT(as->as_vbase1 != 0);
 	KASSERT(as->as_pbase1 != 0);
 	KASSERT(as->as_npages1 != 0);
@@ -228,7 +1770,6 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 	KASSERT((as->as_vbase2 & PAGE_FRAME) == as->as_vbase2);
 	KASSERT((as->as_pbase2 & PAGE_FRAME) == as->as_pbase2);
 	KASSERT((as->as_stackpbase & PAGE_FRAME) == as->as_stackpbase);
-	#endif /* OPT_A3 */
 	
 	vbase1 = as->as_vbase1;
 	vtop1 = vbase1 + as->as_npages1 * PAGE_SIZE;
@@ -238,29 +1779,18 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 	stacktop = USERSTACK;
 
 	if (faultaddress >= vbase1 && faultaddress < vtop1) {
-		#if OPT_A3
-		paddr = as->as_pbase1[(faultaddress - vbase1)/PAGE_SIZE];
-		#else
 		paddr = (faultaddress - vbase1) + as->as_pbase1;
-		#endif
 	}
 	else if (faultaddress >= vbase2 && faultaddress < vtop2) {
-		#if OPT_A3
-                paddr = as->as_pbase2[(faultaddress - vbase2)/PAGE_SIZE];
-                #else
 		paddr = (faultaddress - vbase2) + as->as_pbase2;
-		#endif
 	}
 	else if (faultaddress >= stackbase && faultaddress < stacktop) {
-		#if OPT_A3
-                paddr = as->as_stackpbase[(faultaddress - stackbase)/PAGE_SIZE];
-                #else
 		paddr = (faultaddress - stackbase) + as->as_stackpbase;
-		#endif
 	}
 	else {
 		return EFAULT;
 	}
+	#endif /* OPT_A3 */
 
 	/* make sure it's page-aligned */
 	KASSERT((paddr & PAGE_FRAME) == paddr);
@@ -268,38 +1798,48 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 	/* Disable interrupts on this CPU while frobbing the TLB. */
 	spl = splhigh();
 
+	#if OPT_A3
+	/*
+	 * Frames still shared with a parent or child are mapped
+	 * read-only, so the first write comes back as VM_FAULT_READONLY
+	 * and gets its own copy above. MAP_SHARED pages are written in
+	 * place by every mapper, but are also mapped read-only until
+	 * the first write, which marks the frame for write-back.
+	 */
+	elo = paddr | TLBLO_VALID;
+	if (region->vr_shared) {
+		if (writeable && faulttype != VM_FAULT_READ) {
+			coremap_entry(paddr)->cm_dirty = 1;
+			elo |= TLBLO_DIRTY;
+		}
+	}
+	else if (writeable && vm_page_refcount(paddr) == 1) {
+		elo |= TLBLO_DIRTY;
+	}
+	DEBUG(DB_VM, "dumbvm: 0x%x -> 0x%x\n", faultaddress, paddr);
+	vm_tlb_install(faultaddress, elo, true);
+	#if VM_FAULTAROUND > 0
+	if (faulttype != VM_FAULT_READONLY) {
+		vm_fault_around(as, region, faultaddress, writeable);
+	}
+	#endif /* VM_FAULTAROUND */
+	splx(spl);
+	lock_release(vm_lock);
+	return 0;
+	#else
 	for (i=0; i<NUM_TLB; i++) {
 		tlb_read(&ehi, &elo, i);
 		if (elo & TLBLO_VALID) {
 			continue;
 		}
 		ehi = faultaddress;
-                #if OPT_A3
-		elo = paddr | TLBLO_VALID;
-                if ((!as->as_loaded) || faultaddress < vbase1 || faultaddress >= vtop1) {
-                	elo |= TLBLO_DIRTY;
-                }
-                #else
                 elo = paddr | TLBLO_DIRTY | TLBLO_VALID;
-                #endif /* OPT_A3 */
 		DEBUG(DB_VM, "dumbvm: 0x%x -> 0x%x\n", faultaddress, paddr);
 		tlb_write(ehi, elo, i);
 		splx(spl);
 		return 0;
 	}
-        
-        #if OPT_A3
-        tlb_read(&ehi, &elo, i);
-        ehi = faultaddress;
-        elo = paddr | TLBLO_VALID;
-        if ((!as->as_loaded) || faultaddress < vbase1 || faultaddress >= vtop1) {
-                        elo |= TLBLO_DIRTY;
-                }
-        DEBUG(DB_VM, "dumbvm: 0x%x -> 0x%x\n", faultaddress, paddr);
-        tlb_random(ehi, elo);
-        splx(spl);
-        return 0;
-        #else
+
 	kprintf("dumbvm: Ran out of TLB entries - cannot handle page fault\n");
 	splx(spl);
 	return EFAULT;
@@ -314,14 +1854,20 @@ as_create(void)
 		return NULL;
 	}
 	#if OPT_A3
-	as->as_vbase1 = 0;
-	as->as_pbase1 = NULL;
-	as->as_npages1 = 0;
-	as->as_vbase2 = 0;
-        as->as_pbase2 = NULL;
-	as->as_npages2 = 0;
-	as->as_stackpbase = NULL;	
-        as->as_loaded = 0;
+	as->as_loaded = 0;
+	as->as_regions = NULL;
+	as->as_lastregion = NULL;
+	as->as_asid = 0;
+	as->as_asidgen = 0;
+	as->as_heap = NULL;
+	as->as_heapbrk = 0;
+	as->as_cpumask = 0;
+	as->as_pagetable = kmalloc(PT_L1_SIZE * sizeof(paddr_t *));
+	if (as->as_pagetable == NULL) {
+		kfree(as);
+		return NULL;
+	}
+	bzero(as->as_pagetable, PT_L1_SIZE * sizeof(paddr_t *));
 	#else
 	as->as_vbase1 = 0;
 	as->as_pbase1 = 0;
@@ -335,22 +1881,25 @@ as_create(void)
 	return as;
 }
 
+#if OPT_A3
+static void as_unmap_region(struct addrspace *as, struct vm_region *r);
+#endif /* OPT_A3 */
+
 void
 as_destroy(struct addrspace *as)
 {
 	#if OPT_A3
-	for (int i = 0; i < (int)as->as_npages1; i++) {
-		free_kpages(PADDR_TO_KVADDR(as->as_pbase1[i]));
-	}
-	for (int i = 0; i < (int)as->as_npages2; i++) {
-		free_kpages(PADDR_TO_KVADDR(as->as_pbase2[i]));
-	}
-	for (int i = 0; i< DUMBVM_STACKPAGES; i++) {
-		free_kpages(PADDR_TO_KVADDR(as->as_stackpbase[i]));
+	struct vm_region *r;
+
+	for (r = as->as_regions; r != NULL; r = r->vr_next) {
+		if (r->vr_shared) {
+			as_unmap_region(as, r);
+		}
 	}
-	kfree(as->as_pbase1);
-kfree(as->as_pbase2);
-kfree(as->as_stackpbase);
+	lock_acquire(vm_lock);
+	pt_destroy(as);
+	lock_release(vm_lock);
+	as_free_regions(as);
 	#endif
 	kfree(as);
 }
@@ -358,7 +1907,12 @@ kfree(as->as_stackpbase);
 void
 as_activate(void)
 {
-	int i, spl;
+	#if OPT_A3
+	uint32_t gen;
+	#else
+	int i;
+	#endif /* OPT_A3 */
+	int spl;
 	struct addrspace *as;
 
 	as = curproc_getas();
@@ -372,9 +1926,36 @@ as_activate(void)
 	/* Disable interrupts on this CPU while frobbing the TLB. */
 	spl = splhigh();
 
+	#if OPT_A3
+	spinlock_acquire(&asid_lock);
+	if (as->as_asidgen != asid_generation) {
+		if (asid_next == NUM_TLBPID) {
+			asid_generation++;
+			asid_next = 1;
+		}
+		as->as_asid = asid_next++;
+		as->as_asidgen = asid_generation;
+	}
+	gen = asid_generation;
+	spinlock_release(&asid_lock);
+
+	curcpu->c_tlbpid = as->as_asid;
+	/* from now on this cpu may hold translations for as */
+	KASSERT(curcpu->c_number < VM_MAXCPUS);
+	as->as_cpumask |= (uint32_t)1 << curcpu->c_number;
+	if (curcpu->c_asidgen != gen) {
+		/* IDs have been recycled since this TLB was last flushed */
+		vm_tlb_flush();
+		curcpu->c_asidgen = gen;
+	}
+	else {
+		vm_tlb_restore_pid();
+	}
+	#else
 	for (i=0; i<NUM_TLB; i++) {
 		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
 	}
+	#endif /* OPT_A3 */
 
 	splx(spl);
 }
@@ -386,10 +1967,30 @@ as_deactivate(void)
 }
 
 int
+#if OPT_A3
+as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
+		 int readable, int writeable, int executable,
+		 struct vnode *v, off_t offset, size_t filesz)
+#else
 as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
 		 int readable, int writeable, int executable)
+#endif /* OPT_A3 */
 {
 	size_t npages; 
+	#if OPT_A3
+	struct vm_region *r;
+	vaddr_t fileva = vaddr;
+	int result;
+
+	/*
+	 * Lazily loaded pages are filled in by the kernel rather than
+	 * through uiomove, so check for kernel addresses here.
+	 */
+	if (vaddr >= USERSPACETOP || sz > USERSPACETOP - vaddr) {
+		return EFAULT;
+	}
+	KASSERT(filesz <= sz);
+	#endif /* OPT_A3 */
 
 	/* Align the region. First, the base... */
 	sz += vaddr & ~(vaddr_t)PAGE_FRAME;
@@ -400,6 +2001,21 @@ as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
 
 	npages = sz / PAGE_SIZE;
 
+	#if OPT_A3
+	result = as_add_region(as, vaddr, npages, 0,
+			       readable, writeable, executable, &r);
+	if (result) {
+		return result;
+	}
+	if (v != NULL && filesz > 0) {
+		VOP_INCREF(v);
+		r->vr_vnode = v;
+		r->vr_fileva = fileva;
+		r->vr_offset = offset;
+		r->vr_filesz = filesz;
+	}
+	return 0;
+	#else
 	/* We don't use these - all pages are read-write */
 	(void)readable;
 	(void)writeable;
@@ -421,14 +2037,129 @@ as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
 	 */
 	kprintf("dumbvm: Warning: too many regions\n");
 	return EUNIMP;
+	#endif /* OPT_A3 */
 }
 
+#if !OPT_A3
+/* A3 gets zeroed frames from vm_alloc_zpage instead */
 static
 void
 as_zero_region(paddr_t paddr, unsigned npages)
 {
 	bzero((void *)PADDR_TO_KVADDR(paddr), npages * PAGE_SIZE);
 }
+#endif /* !OPT_A3 */
+
+#if OPT_A3
+#if !AS_LAZYLOAD
+/*
+ * Give every page in region R a zeroed frame.
+ */
+static
+int
+as_fill_region(struct addrspace *as, struct vm_region *r)
+{
+	paddr_t *pte;
+	vaddr_t va;
+	int result = 0;
+
+	lock_acquire(vm_lock);
+	for (size_t i = 0; i < r->vr_npages; i++) {
+		va = r->vr_base + i * PAGE_SIZE;
+		pte = pt_lookup(as, va, true);
+		if (pte == NULL) {
+			result = ENOMEM;
+			break;
+		}
+		*pte = vm_alloc_zpage();
+		if (*pte == 0) {
+			result = ENOMEM;
+			break;
+		}
+		vm_page_claim(*pte, as, va, pte);
+	}
+	lock_release(vm_lock);
+	return result;
+}
+#endif /* !AS_LAZYLOAD */
+
+/*
+ * Make NEW share every resident frame in OLD's page table; both sides
+ * keep a reference. Swap slots are not shared, so swapped pages are
+ * read into a fresh frame for the child. Call with vm_lock held.
+ */
+static
+int
+pt_share(struct addrspace *new, struct addrspace *old)
+{
+	paddr_t *oldl2, *newl2;
+	int result;
+
+	for (unsigned i = 0; i < PT_L1_SIZE; i++) {
+		oldl2 = old->as_pagetable[i];
+		if (oldl2 == NULL) {
+			continue;
+		}
+		newl2 = kmalloc(PT_L2_SIZE * sizeof(paddr_t));
+		if (newl2 == NULL) {
+			return ENOMEM;
+		}
+		bzero(newl2, PT_L2_SIZE * sizeof(paddr_t));
+		new->as_pagetable[i] = newl2;
+
+		for (unsigned j = 0; j < PT_L2_SIZE; j++) {
+			if (oldl2[j] == 0) {
+				continue;
+			}
+			if (PTE_IS_SWAPPED(oldl2[j])) {
+				newl2[j] = vm_alloc_upage();
+				if (newl2[j] == 0) {
+					return ENOMEM;
+				}
+				result = vm_swap_read(newl2[j],
+						      PTE_SLOT(oldl2[j]), false);
+				if (result) {
+					return result;
+				}
+				continue;
+			}
+			vm_page_ref(oldl2[j]);
+			newl2[j] = oldl2[j];
+		}
+	}
+	return 0;
+}
+
+/*
+ * Give NEW a copy of each of OLD's regions.
+ */
+static
+int
+as_copy_regions(struct addrspace *new, struct addrspace *old)
+{
+	struct vm_region *r, *copy, **tail;
+
+	tail = &new->as_regions;
+	for (r = old->as_regions; r != NULL; r = r->vr_next) {
+		copy = kmalloc(sizeof(*copy));
+		if (copy == NULL) {
+			return ENOMEM;
+		}
+		*copy = *r;
+		copy->vr_next = NULL;
+		if (r == old->as_heap) {
+			new->as_heap = copy;
+		}
+		if (copy->vr_vnode != NULL) {
+			/* pages not touched yet still come from the file */
+			VOP_INCREF(copy->vr_vnode);
+		}
+		*tail = copy;
+		tail = &copy->vr_next;
+	}
+	return 0;
+}
+#endif /* OPT_A3 */
 
 int
 as_prepare_load(struct addrspace *as)
@@ -439,47 +2170,29 @@ as_prepare_load(struct addrspace *as)
 	
 
 	#if OPT_A3
-	as->as_pbase1 = kmalloc(as->as_npages1 * sizeof(paddr_t));
-	if (as->as_pbase1 == NULL) {
-		return ENOMEM;
-	}
-	for (int i = 0; i < (int)as->as_npages1; i++) {
-		as->as_pbase1[i] = getppages(1);
-		as_zero_region(as->as_pbase1[i], 1);
+	#if AS_LAZYLOAD
+	/* Pages are allocated by vm_fault as they are touched */
+	(void)as;
+	#else
+	struct vm_region *r;
+
+	for (r = as->as_regions; r != NULL; r = r->vr_next) {
+		if (as_fill_region(as, r)) {
+			return ENOMEM;
+		}
 	}
+	#endif /* AS_LAZYLOAD */
 	#else
 	as->as_pbase1 = getppages(as->as_npages1);
 	if (as->as_pbase1 == 0) {
 		return ENOMEM;
 	}
-	#endif
-	
-	#if OPT_A3
-        as->as_pbase2 = kmalloc(as->as_npages2 * sizeof(paddr_t));
-        if (as->as_pbase2 == NULL) {
-                return ENOMEM;
-        }
-        for (int i = 0; i < (int)as->as_npages2; i++) {
-                as->as_pbase2[i] = getppages(1);
-		as_zero_region(as->as_pbase2[i], 1);
-        }
-        #else
+
 	as->as_pbase2 = getppages(as->as_npages2);
 	if (as->as_pbase2 == 0) {
 		return ENOMEM;
 	}
-	#endif
 
-	#if OPT_A3
-        as->as_stackpbase = kmalloc(DUMBVM_STACKPAGES * sizeof(paddr_t));
-        if (as->as_stackpbase == NULL) {
-                return ENOMEM;
-        }
-        for (int i = 0; i < (int)DUMBVM_STACKPAGES; i++) {
-                as->as_stackpbase[i] = getppages(1);
-		as_zero_region(as->as_stackpbase[i], 1);
-        }
-        #else
 	as->as_stackpbase = getppages(DUMBVM_STACKPAGES);
 	if (as->as_stackpbase == 0) {
 		return ENOMEM;
@@ -496,7 +2209,25 @@ int
 as_complete_load(struct addrspace *as)
 {
         #if OPT_A3
+	struct vm_region *r;
+	vaddr_t heapbase = 0;
+	int result;
+
+	/* The heap starts out empty, on the page after the last segment */
+	for (r = as->as_regions; r != NULL; r = r->vr_next) {
+		heapbase = r->vr_base + r->vr_npages * PAGE_SIZE;
+	}
+	result = as_add_region(as, heapbase, 0, 0, 1, 1, 0, &as->as_heap);
+	if (result) {
+		return result;
+	}
+	as->as_heapbrk = heapbase;
+
         as->as_loaded = 1;
+	#if !AS_LAZYLOAD
+	/* drop the writable mappings used to load the text segment */
+	vm_tlb_shootdown(as, NULL, 0);
+	#endif /* !AS_LAZYLOAD */
         #else
 	(void)as;
         #endif /* OPT_A3 */
@@ -506,70 +2237,412 @@ as_complete_load(struct addrspace *as)
 int
 as_define_stack(struct addrspace *as, vaddr_t *stackptr)
 {
+	#if OPT_A3
+	struct vm_region *r;
+	int result;
+
+	/*
+	 * Reserve the whole stack but allocate nothing: vm_fault
+	 * zero-fills each page as the stack grows into it, even when
+	 * AS_LAZYLOAD is off, so a process only pays for the depth it
+	 * actually uses.
+	 */
+	result = as_add_region(as, USERSTACK - AS_STACKPAGES * PAGE_SIZE,
+			       AS_STACKPAGES, AS_GUARDPAGES, 1, 1, 0, &r);
+	if (result) {
+		return result;
+	}
+	#else
 	KASSERT(as->as_stackpbase != 0);
+	#endif /* OPT_A3 */
 
 	*stackptr = USERSTACK;
 	return 0;
 }
 
+#if OPT_A3
+/*
+ * Give back the heap pages from index FIRST of the heap region up to
+ * its current end: resident frames are unreferenced and swap slots
+ * freed, so a shrinking heap returns its memory straight away.
+ */
+static
+void
+as_heap_release(struct addrspace *as, size_t first)
+{
+	struct vm_region *r = as->as_heap;
+	paddr_t *pte;
+	vaddr_t va;
+
+	lock_acquire(vm_lock);
+	vm_tlb_shootdown_range(as, r->vr_base + first * PAGE_SIZE,
+			       r->vr_npages - first);
+	for (size_t i = first; i < r->vr_npages; i++) {
+		va = r->vr_base + i * PAGE_SIZE;
+		pte = pt_lookup(as, va, false);
+		if (pte == NULL || *pte == 0) {
+			continue;
+		}
+		if (PTE_IS_SWAPPED(*pte)) {
+			swap_free(PTE_SLOT(*pte));
+		}
+		else {
+			vm_page_unref(*pte);
+		}
+		*pte = 0;
+	}
+	lock_release(vm_lock);
+}
+
+int
+as_sbrk(struct addrspace *as, intptr_t amount, vaddr_t *oldbrk)
+{
+	struct vm_region *r = as->as_heap;
+	vaddr_t newbrk, limit;
+	size_t npages;
+
+	if (r == NULL) {
+		return ENOMEM;
+	}
+	*oldbrk = as->as_heapbrk;
+	/* negate as unsigned: -amount overflows for INTPTR_MIN */
+	if (amount < 0 &&
+	    (vaddr_t)0 - (vaddr_t)amount > as->as_heapbrk - r->vr_base) {
+		return EINVAL;
+	}
+
+	/* Growth stops at the next region, or at its guard pages */
+	limit = r->vr_next != NULL ?
+		r->vr_next->vr_base - r->vr_next->vr_guard * PAGE_SIZE :
+		USERSPACETOP;
+	if (amount > 0 && (vaddr_t)amount > limit - as->as_heapbrk) {
+		return ENOMEM;
+	}
+
+	newbrk = as->as_heapbrk + amount;
+	npages = (newbrk - r->vr_base + PAGE_SIZE - 1) / PAGE_SIZE;
+	if (npages < r->vr_npages) {
+		as_heap_release(as, npages);
+	}
+	/* new pages are zero-filled by vm_fault when first touched */
+	r->vr_npages = npages;
+	as->as_heapbrk = newbrk;
+	return 0;
+}
+
+/*
+ * Find room for NPAGES pages above the heap, as high as possible so
+ * that the heap keeps its room to grow. Returns 0 if there is none.
+ */
+static
+vaddr_t
+as_find_gap(struct addrspace *as, size_t npages)
+{
+	struct vm_region *r;
+	vaddr_t prevend = 0, end, best = 0;
+	bool aboveheap = as->as_heap == NULL;
+
+	for (r = as->as_regions; r != NULL; r = r->vr_next) {
+		end = r->vr_base - r->vr_guard * PAGE_SIZE;
+		if (aboveheap && end > prevend &&
+		    (end - prevend) / PAGE_SIZE >= npages) {
+			best = end - npages * PAGE_SIZE;
+		}
+		prevend = r->vr_base + r->vr_npages * PAGE_SIZE;
+		if (r == as->as_heap) {
+			aboveheap = true;
+		}
+	}
+	if (aboveheap && (USERSPACETOP - prevend) / PAGE_SIZE >= npages) {
+		best = USERSPACETOP - npages * PAGE_SIZE;
+	}
+	return best;
+}
+
+int
+as_mmap(struct addrspace *as, struct vnode *v, size_t len, off_t filesize,
+	int prot, bool shared, vaddr_t *ret)
+{
+	struct vm_region *r;
+	size_t npages;
+	vaddr_t base;
+	int result;
+
+	npages = (len + PAGE_SIZE - 1) / PAGE_SIZE;
+	if (npages == 0 || npages > USERSPACETOP / PAGE_SIZE) {
+		return EINVAL;
+	}
+	base = as_find_gap(as, npages);
+	if (base == 0) {
+		return ENOMEM;
+	}
+	result = as_add_region(as, base, npages, 0, prot & PROT_READ,
+			       prot & PROT_WRITE, prot & PROT_EXEC, &r);
+	if (result) {
+		return result;
+	}
+
+	VOP_INCREF(v);
+	r->vr_vnode = v;
+	r->vr_offset = 0;
+	r->vr_filesz = filesize < (off_t)(npages * PAGE_SIZE) ?
+		filesize : npages * PAGE_SIZE;
+	r->vr_mmapped = 1;
+	r->vr_shared = shared;
+	*ret = base;
+	return 0;
+}
+
+/*
+ * Write the page of V at file offset OFFSET, held in PADDR, back to
+ * the file. Only the part within the file's current size is written;
+ * a mapping never extends the file.
+ */
+static
+int
+as_writeback_page(struct vnode *v, off_t offset, paddr_t paddr)
+{
+	struct stat st;
+	struct iovec iov;
+	struct uio u;
+	size_t len;
+	int result;
+
+	result = VOP_STAT(v, &st);
+	if (result) {
+		return result;
+	}
+	if (offset >= st.st_size) {
+		return 0;
+	}
+	len = st.st_size - offset < PAGE_SIZE ? st.st_size - offset : PAGE_SIZE;
+	uio_kinit(&iov, &u, (void *)PADDR_TO_KVADDR(paddr), len,
+		  offset, UIO_WRITE);
+	return VOP_WRITE(v, &u);
+}
+
+/*
+ * Release every page of R. The pages of a MAP_SHARED mapping stay
+ * shared with the other processes mapping the file; whoever drops the
+ * last reference to a dirty one writes it back first. File I/O is
+ * done without vm_lock, holding that last reference: another process
+ * may map the page meanwhile, and if it writes to it and unmaps it
+ * before we are done we write it again, so no change is lost.
+ */
+static
+void
+as_unmap_region(struct addrspace *as, struct vm_region *r)
+{
+	struct CoreEntry *ce;
+	paddr_t *pte, paddr;
+	vaddr_t va;
+	int result;
+
+	/*
+	 * Nothing can fault the region back in: munmap has already
+	 * unlinked it, and as_destroy's process is gone.
+	 */
+	vm_tlb_shootdown_range(as, r->vr_base, r->vr_npages);
+	lock_acquire(vm_lock);
+	for (size_t i = 0; i < r->vr_npages; i++) {
+		va = r->vr_base + i * PAGE_SIZE;
+		pte = pt_lookup(as, va, false);
+		if (pte == NULL || *pte == 0) {
+			continue;
+		}
+		if (PTE_IS_SWAPPED(*pte)) {
+			KASSERT(!r->vr_shared);
+			swap_free(PTE_SLOT(*pte));
+			*pte = 0;
+			continue;
+		}
+		paddr = *pte;
+		*pte = 0;
+		vm_page_disown(paddr);
+		ce = coremap_entry(paddr);
+		while (r->vr_shared && ce->cm_dirty &&
+		       vm_page_refcount(paddr) == 1) {
+			ce->cm_dirty = 0;
+			lock_release(vm_lock);
+			result = as_writeback_page(r->vr_vnode, r->vr_offset +
+						   (va - r->vr_fileva), paddr);
+			if (result) {
+				kprintf("dumbvm: mmap writeback at 0x%x: %s\n",
+					va, strerror(result));
+			}
+			lock_acquire(vm_lock);
+		}
+		vm_page_unref(paddr);
+	}
+	lock_release(vm_lock);
+}
+
+/*
+ * Cut region R at VA, which must lie inside it. R keeps the pages
+ * below VA; UPPER, supplied by the caller, becomes a region of its
+ * own for the rest, following R in the list and holding its own
+ * reference to the file. Only used on mmap regions, whose file image
+ * starts at vr_base.
+ */
+static
+void
+as_split_region(struct vm_region *r, vaddr_t va, struct vm_region *upper)
+{
+	size_t skip = va - r->vr_fileva;
+
+	KASSERT(r->vr_mmapped);
+	KASSERT(va > r->vr_base && va < r->vr_base + r->vr_npages * PAGE_SIZE);
+	KASSERT(r->vr_fileva <= va);
+
+	*upper = *r;
+	upper->vr_base = va;
+	upper->vr_npages = r->vr_npages - (va - r->vr_base) / PAGE_SIZE;
+	upper->vr_guard = 0;
+	upper->vr_fileva = va;
+	upper->vr_offset = r->vr_offset + skip;
+	upper->vr_filesz = r->vr_filesz > skip ? r->vr_filesz - skip : 0;
+	VOP_INCREF(upper->vr_vnode);
+
+	r->vr_npages = (va - r->vr_base) / PAGE_SIZE;
+	if (r->vr_filesz > skip) {
+		r->vr_filesz = skip;
+	}
+	r->vr_next = upper;
+}
+
+/*
+ * Remove the pages in [ADDR, ADDR + LEN) from whatever mmap regions
+ * they are in, splitting a region that is only partly covered. Parts
+ * of the range that are not mapped are ignored, but the range may
+ * not touch a region that mmap did not create.
+ */
+int
+as_munmap(struct addrspace *as, vaddr_t addr, size_t len)
+{
+	struct vm_region *r, **pp, *spare[2];
+	vaddr_t end, rend;
+	unsigned nspare;
+
+	if ((addr & PAGE_FRAME) != addr || len == 0 ||
+	    addr >= USERSPACETOP || len > USERSPACETOP - addr) {
+		return EINVAL;
+	}
+	end = addr + ROUNDUP(len, PAGE_SIZE);
+
+	for (r = as->as_regions; r != NULL && r->vr_base < end;
+	     r = r->vr_next) {
+		if (r->vr_base + r->vr_npages * PAGE_SIZE > addr &&
+		    !r->vr_mmapped) {
+			return EINVAL;
+		}
+	}
+
+	/* at most one cut at each end; allocate before changing anything */
+	spare[0] = kmalloc(sizeof(struct vm_region));
+	spare[1] = kmalloc(sizeof(struct vm_region));
+	if (spare[0] == NULL || spare[1] == NULL) {
+		kfree(spare[0]);
+		kfree(spare[1]);
+		return ENOMEM;
+	}
+	nspare = 2;
+
+	pp = &as->as_regions;
+	while ((r = *pp) != NULL && r->vr_base < end) {
+		rend = r->vr_base + r->vr_npages * PAGE_SIZE;
+		if (rend <= addr) {
+			pp = &r->vr_next;
+			continue;
+		}
+		if (r->vr_base < addr) {
+			/* keep the part below the range */
+			as_split_region(r, addr, spare[--nspare]);
+			pp = &r->vr_next;
+			continue;
+		}
+		if (rend > end) {
+			/* keep the part above the range */
+			as_split_region(r, end, spare[--nspare]);
+		}
+		*pp = r->vr_next;
+		as_unmap_region(as, r);
+		VOP_DECREF(r->vr_vnode);
+		kfree(r);
+	}
+	as->as_lastregion = NULL;
+
+	while (nspare > 0) {
+		kfree(spare[--nspare]);
+	}
+	return 0;
+}
+#endif /* OPT_A3 */
+
 int
 as_copy(struct addrspace *old, struct addrspace **ret)
 {
 	struct addrspace *new;
+	#if OPT_A3
+	int result;
+	#endif /* OPT_A3 */
 
 	new = as_create();
 	if (new==NULL) {
 		return ENOMEM;
 	}	
 	
+	#if OPT_A3
+	/*
+	 * Copy-on-write: instead of duplicating every page, the child
+	 * takes a reference on each of the parent's frames. Both sides
+	 * map shared frames read-only and vm_fault makes the copy on
+	 * the first write, so a fork followed by execv never copies.
+	 */
+	new->as_loaded = old->as_loaded;
+	new->as_heapbrk = old->as_heapbrk;
+	result = as_copy_regions(new, old);
+	if (result) {
+		as_destroy(new);
+		return result;
+	}
+	lock_acquire(vm_lock);
+	result = pt_share(new, old);
+	lock_release(vm_lock);
+	if (result) {
+		as_destroy(new);
+		return result;
+	}
+
+	/*
+	 * The parent may have writable translations for the pages we
+	 * just shared, here or on cpus it ran on before. Drop them so
+	 * its next write faults and copies.
+	 */
+	vm_tlb_shootdown(old, NULL, 0);
+	#else
 	new->as_vbase1 = old->as_vbase1;
 	new->as_npages1 = old->as_npages1;
 	new->as_vbase2 = old->as_vbase2;
 	new->as_npages2 = old->as_npages2;
+
 	/* (Mis)use as_prepare_load to allocate some physical memory. */
 	if (as_prepare_load(new)) {
 		as_destroy(new);
 		return ENOMEM;
 	}
-	
-	#if OPT_A3
-	#else
+
 	KASSERT(new->as_pbase1 != 0);
 	KASSERT(new->as_pbase2 != 0);
 	KASSERT(new->as_stackpbase != 0);
-	#endif /*OPT_A3*/
 
-	#if OPT_A3
-	for (int i = 0; i < (int)new->as_npages1; i++) {
-		memmove((void *)PADDR_TO_KVADDR(new->as_pbase1[i]),
-                (const void *)PADDR_TO_KVADDR(old->as_pbase1[i]),
-                PAGE_SIZE);
-	}
-	#else
 	memmove((void *)PADDR_TO_KVADDR(new->as_pbase1),
 		(const void *)PADDR_TO_KVADDR(old->as_pbase1),
 		old->as_npages1*PAGE_SIZE);
-	#endif /*OPT_A3*/
 
-        #if OPT_A3
-        for (int i = 0; i < (int)new->as_npages2; i++) {
-                memmove((void *)PADDR_TO_KVADDR(new->as_pbase2[i]),
-                (const void *)PADDR_TO_KVADDR(old->as_pbase2[i]),
-                PAGE_SIZE);
-        }
-        #else
 	memmove((void *)PADDR_TO_KVADDR(new->as_pbase2),
 		(const void *)PADDR_TO_KVADDR(old->as_pbase2),
 		old->as_npages2*PAGE_SIZE);
-	#endif /*OPT_A3*/
 
-        #if OPT_A3
-        for (int i = 0; i < (int)DUMBVM_STACKPAGES; i++) {
-                memmove((void *)PADDR_TO_KVADDR(new->as_stackpbase[i]),
-                (const void *)PADDR_TO_KVADDR(old->as_stackpbase[i]),
-                PAGE_SIZE);
-        }
-        #else
 	memmove((void *)PADDR_TO_KVADDR(new->as_stackpbase),
 		(const void *)PADDR_TO_KVADDR(old->as_stackpbase),
 		DUMBVM_STACKPAGES*PAGE_SIZE);
@@ -111,3 +111,4 @@ SRCS+=$(KTOP)/vfs/vfspath.c
 SRCS+=$(KTOP)/vfs/vnode.c
 SRCS+=$(KTOP)/vm/kmalloc.c
 SRCS+=$(KTOP)/vm/uw-vmstats.c
+SRCS+=$(KTOP)/vm/swap.c
@@ -0,0 +1,5 @@
+/* Automatically generated; do not edit */
+#ifndef _OPT_KMALLOCSTATS_H_
+#define _OPT_KMALLOCSTATS_H_
+#define OPT_KMALLOCSTATS 1
+#endif /* _OPT_KMALLOCSTATS_H_ */
@@ -47,16 +47,65 @@ struct vnode;
  * You write this.
  */
 
+#if OPT_A3
+/*
+ * A contiguous range of pages with one set of permissions, such as
+ * an ELF segment or the stack. If vr_vnode is set, the bytes in
+ * [vr_fileva, vr_fileva + vr_filesz) come from the file at vr_offset
+ * and the rest of the region is zero-filled.
+ */
+struct vm_region {
+  vaddr_t vr_base;		/* page aligned */
+  size_t vr_npages;
+  bool vr_readable;
+  bool vr_writeable;
+  bool vr_executable;
+  size_t vr_guard;		/* unmapped pages reserved below vr_base */
+  bool vr_mmapped;		/* created by mmap, removable by munmap */
+  bool vr_shared;		/* MAP_SHARED: pages shared with every
+				   mapper, written back to vr_vnode */
+  struct vnode *vr_vnode;
+  vaddr_t vr_fileva;
+  off_t vr_offset;
+  size_t vr_filesz;
+  struct vm_region *vr_next;	/* sorted by vr_base */
+};
+
+/*
+ * Two-level page table. The top 10 bits of a user address index
+ * as_pagetable, whose entries point to page-sized second-level
+ * tables of PT_L2_SIZE entries, allocated when first needed.
+ */
+#define PT_L1_SHIFT  22
+#define PT_L2_SHIFT  12
+#define PT_L1_SIZE   (USERSPACETOP >> PT_L1_SHIFT)
+#define PT_L2_SIZE   (1 << (PT_L1_SHIFT - PT_L2_SHIFT))
+#define PT_L1_INDEX(va)  ((va) >> PT_L1_SHIFT)
+#define PT_L2_INDEX(va)  (((va) >> PT_L2_SHIFT) & (PT_L2_SIZE - 1))
+
+/*
+ * The stack region reserves AS_STACKPAGES pages below USERSTACK, but
+ * a page only gets a frame when it is first touched. The
+ * AS_GUARDPAGES pages below that are never mapped, so overrunning the
+ * stack faults instead of running into whatever lies beneath it.
+ */
+#define AS_STACKPAGES  256
+#define AS_GUARDPAGES  1
+#endif /* OPT_A3 */
+
 struct addrspace {
   #if OPT_A3
   bool as_loaded;
-  vaddr_t as_vbase1;
-  paddr_t* as_pbase1;
-  size_t as_npages1;
-  vaddr_t as_vbase2;
-  paddr_t* as_pbase2;
-  size_t as_npages2;
-  paddr_t* as_stackpbase;
+  struct vm_region *as_regions;
+  struct vm_region *as_lastregion;	/* hint for vm_fault */
+  paddr_t **as_pagetable;		/* PT_L1_SIZE entries */
+  struct vm_region *as_heap;	/* grown and shrunk by sbrk */
+  vaddr_t as_heapbrk;		/* current break, need not be aligned */
+  /* TLB address space ID, valid while as_asidgen is current */
+  uint32_t as_asid;
+  uint32_t as_asidgen;
+  /* cpus that may hold translations for us, for TLB shootdown */
+  uint32_t as_cpumask;
   #else
   vaddr_t as_vbase1;
   paddr_t as_pbase1;
@@ -91,7 +140,10 @@ struct addrspace {
  *                the way this works if implementing user-level threads.
  *
  *    as_define_region - set up a region of memory within the address
- *                space.
+ *                space. Under OPT_A3 it also records the vnode and file
+ *                offset backing the region, so that pages can be read
+ *                in when they are first touched. Any number of
+ *                non-overlapping regions may be defined.
  *
  *    as_prepare_load - this is called before actually loading from an
  *                executable into the address space.
@@ -99,9 +151,25 @@ struct addrspace {
  *    as_complete_load - this is called when loading from an executable
  *                is complete.
  *
+ *    as_sbrk   - move the end of the heap region by AMOUNT bytes and
+ *                hand back the old end. Pages given up by shrinking
+ *                are freed. Under OPT_A3 the heap is created, empty,
+ *                just above the highest segment by as_complete_load.
+ *
+ *    as_mmap   - map LEN bytes of the file V, whose size is FILESIZE,
+ *                into a free part of the address space and hand back
+ *                its address. Pages are read in by vm_fault.
+ *
+ *    as_munmap - remove the pages in [ADDR, ADDR+LEN) of mappings
+ *                made by as_mmap, splitting a mapping that is only
+ *                partly covered. A changed page of a shared mapping
+ *                is written back to the file once no process maps it.
+ *
  *    as_define_stack - set up the stack region in the address space.
  *                (Normally called *after* as_complete_load().) Hands
  *                back the initial stack pointer for the new process.
+ *                Under OPT_A3 the stack is reserved up to AS_STACKPAGES
+ *                and filled in lazily by vm_fault.
  */
 
 struct addrspace *as_create(void);
@@ -110,16 +178,43 @@ void              as_activate(void);
 void              as_deactivate(void);
 void              as_destroy(struct addrspace *);
 
+#if OPT_A3
+int               as_define_region(struct addrspace *as, 
+                                   vaddr_t vaddr, size_t sz,
+                                   int readable, 
+                                   int writeable,
+                                   int executable,
+                                   struct vnode *v,
+                                   off_t offset, size_t filesz);
+#else
 int               as_define_region(struct addrspace *as, 
                                    vaddr_t vaddr, size_t sz,
                                    int readable, 
                                    int writeable,
                                    int executable);
+#endif /* OPT_A3 */
 int               as_prepare_load(struct addrspace *as);
 int               as_complete_load(struct addrspace *as);
 int               as_define_stack(struct addrspace *as, vaddr_t *initstackptr);
+#if OPT_A3
+int               as_sbrk(struct addrspace *as, intptr_t amount,
+                          vaddr_t *oldbrk);
+int               as_mmap(struct addrspace *as, struct vnode *v,
+                          size_t len, off_t filesize, int prot,
+                          bool shared, vaddr_t *ret);
+int               as_munmap(struct addrspace *as, vaddr_t addr, size_t len);
+#endif /* OPT_A3 */
 
 
+#if OPT_A3
+/*
+ * If AS_LAZYLOAD is set, load_elf only describes the segments and
+ * vm_fault reads each page from the executable (or zero-fills it) on
+ * first touch. Otherwise every page is loaded up front.
+ */
+#define AS_LAZYLOAD 1
+#endif /* OPT_A3 */
+
 /*
  * Functions in loadelf.c
  *    load_elf - load an ELF user program executable into the current
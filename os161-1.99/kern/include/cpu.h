@@ -34,6 +34,61 @@
 #include <spinlock.h>
 #include <threadlist.h>
 #include <machine/vm.h>  /* for TLBSHOOTDOWN_MAX */
+#include "opt-A3.h"
+#include "opt-kmallocstats.h"
+
+#if OPT_A3
+/*
+ * Per-cpu cache of free page frames for single-page alloc_kpages and
+ * free_kpages. It is refilled from, and drained to, the global frame
+ * allocator CPU_FRAME_BATCH frames at a time.
+ */
+#define CPU_FRAME_MAG    16
+#define CPU_FRAME_BATCH  8
+#endif /* OPT_A3 */
+
+/*
+ * Per-cpu cache of reaped threads that still have their kernel
+ * stacks, for thread_fork to reuse.
+ */
+#define CPU_THREAD_CACHE    8
+
+/*
+ * Per-cpu magazines of free kmalloc blocks, one for each subpage size
+ * class, exchanged with the global subpage pages CPU_KMALLOC_BATCH
+ * blocks at a time. CPU_KMALLOC_NSIZES must match kmalloc.c.
+ */
+#define CPU_KMALLOC_NSIZES  8
+#define CPU_KMALLOC_MAG     16
+#define CPU_KMALLOC_BATCH   8
+
+#if OPT_KMALLOCSTATS
+/*
+ * Per-cpu kmalloc profile (options kmallocstats): a request-size
+ * histogram, totals per size class (plus one for whole pages), and a
+ * small open-addressed table of call sites. kheap_printsizes adds up
+ * every cpu's copy; km_gen lets kheap_resetsizes ask each cpu to
+ * clear its own. See kmalloc.c.
+ */
+#define CPU_KMSTAT_NBUCKETS 12	/* <=8, <=16, ... <=8192, bigger */
+#define CPU_KMSTAT_NSITES   128	/* power of 2 */
+
+struct kmstat_site {
+	vaddr_t ks_site;
+	unsigned ks_count;
+	uint64_t ks_bytes;
+};
+
+struct kmstat {
+	unsigned km_gen;
+	unsigned km_hist[CPU_KMSTAT_NBUCKETS];
+	unsigned km_allocs[CPU_KMALLOC_NSIZES+1];
+	uint64_t km_reqbytes[CPU_KMALLOC_NSIZES+1];
+	uint64_t km_gotbytes[CPU_KMALLOC_NSIZES+1];
+	struct kmstat_site km_sites[CPU_KMSTAT_NSITES];
+	unsigned km_othersites;
+};
+#endif /* OPT_KMALLOCSTATS */
 
 
 /*
@@ -59,7 +114,37 @@ struct cpu {
 	 */
 	struct thread *c_curthread;	/* Current thread on cpu */
 	struct threadlist c_zombies;	/* List of exited threads */
+	struct threadlist c_threadcache; /* Reaped threads, for reuse */
+	unsigned c_threadcache_hits;	/* thread_fork reusing a thread */
+	unsigned c_threadcache_misses;	/* thread_fork starting afresh */
 	unsigned c_hardclocks;		/* Counter of hardclock() calls */
+	unsigned c_idleclocks;		/* ...of which taken while idle */
+	unsigned c_lock_spun;		/* lock_acquire got it by spinning */
+	unsigned c_lock_slept;		/* ...had to sleep */
+	unsigned c_lock_handoffs;	/* lock_release handed it over */
+#if OPT_A3
+	/* Also only touched at splhigh. */
+	paddr_t c_frames[CPU_FRAME_MAG];	/* Cached free frames */
+	unsigned c_nframes;
+	unsigned c_frame_allochits;	/* alloc served from the cache */
+	unsigned c_frame_allocmisses;	/* alloc that had to refill */
+	unsigned c_frame_freehits;	/* free absorbed by the cache */
+	unsigned c_frame_freemisses;	/* free that had to drain */
+	uint32_t c_asidgen;		/* ASID generation of our TLB */
+	uint32_t c_tlbpid;		/* ASID of the active address space */
+	unsigned c_tlbhand;		/* clock hand over TLB slots */
+	uint64_t c_tlbref;		/* software referenced bit per slot */
+#endif /* OPT_A3 */
+	/* Also only touched at splhigh; see kmalloc.c. */
+	void *c_kmag[CPU_KMALLOC_NSIZES][CPU_KMALLOC_MAG];
+	unsigned c_nkmag[CPU_KMALLOC_NSIZES];
+	unsigned c_kmalloc_hits;	/* kmalloc served from a magazine */
+	unsigned c_kmalloc_misses;	/* kmalloc that had to refill */
+	unsigned c_kfree_hits;		/* kfree absorbed by a magazine */
+	unsigned c_kfree_misses;	/* kfree that had to drain */
+#if OPT_KMALLOCSTATS
+	struct kmstat c_kmstat;		/* Also only touched at splhigh */
+#endif
 
 	/*
 	 * Accessed by other cpus.
@@ -68,6 +153,8 @@ struct cpu {
 	bool c_isidle;			/* True if this cpu is idle */
 	struct threadlist c_runqueue;	/* Run queue for this cpu */
 	struct spinlock c_runqueue_lock;
+	unsigned c_steals;		/* Threads we took from other cpus */
+	unsigned c_stolen;		/* Threads other cpus took from us */
 
 	/*
 	 * Accessed by other cpus.
@@ -82,10 +169,17 @@ struct cpu {
 	 * struct tlbshootdown is machine-dependent and might
 	 * reasonably be either an address space and vaddr pair, or a
 	 * paddr, or something else.
+	 *
+	 * c_shootdown_seq counts the batches of shootdowns this cpu
+	 * has finished, so that a sender can wait for its request.
+	 * c_shootdown_ipis counts the interrupts actually sent; a
+	 * request queued while one is already pending rides along.
 	 */
 	uint32_t c_ipi_pending;		/* One bit for each IPI number */
 	struct tlbshootdown c_shootdown[TLBSHOOTDOWN_MAX];
 	int c_numshootdown;
+	unsigned c_shootdown_seq;
+	unsigned c_shootdown_ipis;
 	struct spinlock c_ipi_lock;
 };
 
@@ -109,6 +203,13 @@ void cpu_machdep_init(struct cpu *);
 /*ASMLINKAGE*/ void cpu_start_secondary(void);
 void cpu_hatch(unsigned software_number);
 
+/*
+ * Number of cpus, and the cpu with software number N, for code
+ * outside the thread system that keeps per-cpu state.
+ */
+unsigned cpu_count(void);
+struct cpu *cpu_get(unsigned n);
+
 /*
  * Return a string describing the CPU type.
  */
@@ -139,6 +240,13 @@ void cpu_irqon(void);
 void cpu_idle(void);
 void cpu_halt(void);
 
+/*
+ * Read the current CPU's cycle counter. It wraps, so only differences
+ * between two readings are meaningful, and counters on different CPUs
+ * are not guaranteed to agree.
+ */
+uint32_t cpu_cycles(void);
+
 /*
  * Interprocessor interrupts.
  *
@@ -152,6 +260,10 @@ void cpu_halt(void);
  * ipi_send sends an IPI to one CPU.
  * ipi_broadcast sends an IPI to all CPUs except the current one.
  * ipi_tlbshootdown is like ipi_send but carries TLB shootdown data.
+ * It returns a ticket to pass to ipi_tlbshootdown_wait, which spins
+ * until the target has carried the shootdown out. Do not wait while
+ * holding a spinlock: the target might be spinning on it with
+ * interrupts off.
  *
  * interprocessor_interrupt is called on the target CPU when an IPI is
  * received.
@@ -165,7 +277,9 @@ void cpu_halt(void);
 
 void ipi_send(struct cpu *target, int code);
 void ipi_broadcast(int code);
-void ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping);
+unsigned ipi_tlbshootdown(struct cpu *target,
+			  const struct tlbshootdown *mapping);
+void ipi_tlbshootdown_wait(struct cpu *target, unsigned ticket);
 
 void interprocessor_interrupt(void);
 
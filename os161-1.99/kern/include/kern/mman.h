@@ -0,0 +1,37 @@
+#ifndef _KERN_MMAN_H_
+#define _KERN_MMAN_H_
+
+/*
+ * Constants for mmap(), shared between the kernel and libc.
+ *
+ * OS/161 has no file table, so mmap names the file by path and always
+ * maps it from offset 0:
+ *
+ *     void *mmap(const char *path, size_t length, int prot, int flags);
+ *     int munmap(void *addr, size_t length);
+ *
+ * Exactly one of MAP_SHARED and MAP_PRIVATE must be given. Every
+ * MAP_SHARED mapping of a file, including those inherited by fork,
+ * sees the same pages. A changed page is written back to the file
+ * when the last mapping of it goes away, by munmap or at exit; a
+ * mapping never extends the file. A page past the end of the file
+ * reads as zeros, including one that was in the file when it was
+ * mapped but was truncated away before it was first touched.
+ *
+ * munmap takes a page-aligned ADDR and may cover any part of one or
+ * more mappings, or none; it fails with EINVAL if the range touches
+ * memory that mmap did not map.
+ */
+
+/* prot */
+#define PROT_NONE     0
+#define PROT_READ     1
+#define PROT_WRITE    2
+#define PROT_EXEC     4
+
+/* flags */
+#define MAP_SHARED    1
+#define MAP_PRIVATE   2
+
+
+#endif /* _KERN_MMAN_H_ */
@@ -0,0 +1,59 @@
+#ifndef _KMEM_H_
+#define _KMEM_H_
+
+/*
+ * Object caches ("slabs") for fixed-size kernel structures.
+ *
+ * A cache hands out objects of a single size carved from whole pages,
+ * so allocating and freeing them never touches the general subpage
+ * allocator. If the cache has a constructor it is run once, when the
+ * object's slab is created, and the destructor once, when the slab is
+ * given back; an object freed to the cache keeps its constructed
+ * state (for example an already-created wchan) for the next caller.
+ *
+ * Caches are declared statically with KMEM_CACHE_INITIALIZER, so they
+ * can be used from the earliest point of boot. A cache shows up in
+ * kheap_printstats once it has allocated its first slab.
+ */
+
+#include <spinlock.h>
+
+struct kmem_slab;	/* Private to kmalloc.c */
+
+struct kmem_cache {
+	const char *kc_name;
+	size_t kc_size;
+	int (*kc_ctor)(void *obj);	/* may be NULL; returns errno */
+	void (*kc_dtor)(void *obj);	/* may be NULL */
+
+	struct spinlock kc_lock;
+	struct kmem_slab *kc_slabs;	/* slabs with at least one free object */
+	struct kmem_cache *kc_next;	/* on the list of all caches */
+	bool kc_listed;
+
+	/* statistics, protected by kc_lock */
+	unsigned kc_nslabs;		/* slabs currently held */
+	unsigned kc_nempty;		/* ...of which completely free */
+	unsigned kc_inuse;		/* objects handed out */
+	unsigned kc_allocs;		/* total kmem_cache_alloc calls */
+	unsigned kc_frees;		/* total kmem_cache_free calls */
+	unsigned kc_grows;		/* slabs created */
+	unsigned kc_reaps;		/* slabs given back */
+};
+
+#define KMEM_CACHE_INITIALIZER(name, size, ctor, dtor) \
+	{ name, size, ctor, dtor, SPINLOCK_INITIALIZER, NULL, NULL, false, \
+	  0, 0, 0, 0, 0, 0, 0 }
+
+/*
+ * Get an object from the cache, or NULL if out of memory. The object
+ * is in whatever state the constructor (or the last user) left it.
+ */
+void *kmem_cache_alloc(struct kmem_cache *kc);
+
+/*
+ * Return an object to the cache it came from.
+ */
+void kmem_cache_free(struct kmem_cache *kc, void *obj);
+
+#endif /* _KMEM_H_ */
@@ -127,6 +127,13 @@ void *kmalloc(size_t size);
 void kfree(void *ptr);
 void kheap_printstats(void);
 
+/*
+ * kmalloc request-size histogram, waste per size class, and busiest
+ * callers. Only available with "options kmallocstats".
+ */
+void kheap_printsizes(void);
+void kheap_resetsizes(void);
+
 /*
  * C string functions. 
  *
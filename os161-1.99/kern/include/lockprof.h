@@ -0,0 +1,59 @@
+#ifndef _LOCKPROF_H_
+#define _LOCKPROF_H_
+
+/*
+ * Lock contention profiling (options lockstats).
+ *
+ * Every spinlock, lock and semaphore carries a struct lockprof that
+ * counts acquisitions, how many of them had to wait, and the total
+ * and longest wait and the longest hold, in cycles of the on-chip
+ * counter. A lockprof puts itself on a global list the first time
+ * its lock is contended, so the list holds exactly the locks worth
+ * looking at; lockprof_print shows the most contended of them.
+ *
+ * The counters are updated while holding the lock being profiled,
+ * so they need no locking of their own. Semaphores have no holder,
+ * so for them only the wait side is meaningful.
+ */
+
+#include <cdefs.h>
+
+struct lockprof {
+	const char *lp_name;		/* NULL for spinlocks */
+	const void *lp_lock;		/* the lock itself, for printing */
+	unsigned lp_acquires;		/* acquisitions */
+	unsigned lp_contended;		/* ...that had to wait */
+	uint64_t lp_waittotal;		/* cycles spent waiting */
+	uint32_t lp_waitmax;		/* longest single wait */
+	uint32_t lp_holdmax;		/* longest single hold */
+	uint32_t lp_holdstart;		/* when the current hold began */
+	const void *lp_caller;		/* last contended acquire site */
+	struct lockprof *lp_next;	/* on the list of contended locks */
+	bool lp_listed;
+};
+
+#define LOCKPROF_INITIALIZER \
+	{ NULL, NULL, 0, 0, 0, 0, 0, 0, NULL, NULL, false }
+
+/*
+ * init		Set up (or reset) the profile for a lock that is being
+ *		created. NAME is not copied and must outlive the lock.
+ * cleanup	Take the profile off the list before the lock goes away.
+ *
+ * acquired	Record an acquisition. WAITSTART is the cycle count when
+ *		the caller started trying to get the lock; CONTENDED says
+ *		whether it had to wait. Starts the hold timer.
+ * released	Record the end of a hold.
+ *
+ * print	Show the N most contended locks.
+ * reset	Zero the counters of every listed lock and empty the list.
+ */
+void lockprof_init(struct lockprof *lp, const void *lock, const char *name);
+void lockprof_cleanup(struct lockprof *lp);
+void lockprof_acquired(struct lockprof *lp, uint32_t waitstart,
+		       bool contended, const void *caller);
+void lockprof_released(struct lockprof *lp);
+void lockprof_print(unsigned n);
+void lockprof_reset(void);
+
+#endif /* _LOCKPROF_H_ */
@@ -45,9 +45,20 @@
 /* Get the machine-dependent bits. */
 #include <machine/spinlock.h>
 
+#include "opt-lockstats.h"
+#if OPT_LOCKSTATS
+#include <lockprof.h>
+#endif
+
 /*
  * Basic spinlock.
  *
+ * Spinlocks are ticket locks: an acquirer atomically takes the next
+ * number from lk_next and waits until lk_serving reaches it, and
+ * release advances lk_serving. CPUs therefore get the lock in the
+ * order they asked for it, and waiters only read lk_serving while
+ * they spin instead of all retrying an atomic operation on it.
+ *
  * Note that spinlocks are held by CPUs, not by threads.
  *
  * This structure is made public so spinlocks do not have to be
@@ -55,14 +66,25 @@
  * the structure directly but always use the spinlock API functions.
  */
 struct spinlock {
-	volatile spinlock_data_t lk_lock; /* The memory word where we spin. */
+	volatile spinlock_data_t lk_next; /* Next ticket to hand out. */
+	volatile spinlock_data_t lk_serving; /* Ticket allowed in; we spin here. */
 	struct cpu *lk_holder;		/* CPU holding this lock. */
+#if OPT_LOCKSTATS
+	struct lockprof lk_prof;	/* contention profile */
+#endif
 };
 
 /*
  * Initializer for cases where a spinlock needs to be static or global.
  */
-#define SPINLOCK_INITIALIZER	{ SPINLOCK_DATA_INITIALIZER, NULL }
+#if OPT_LOCKSTATS
+#define SPINLOCK_INITIALIZER \
+	{ SPINLOCK_DATA_INITIALIZER, SPINLOCK_DATA_INITIALIZER, NULL, \
+	  LOCKPROF_INITIALIZER }
+#else
+#define SPINLOCK_INITIALIZER \
+	{ SPINLOCK_DATA_INITIALIZER, SPINLOCK_DATA_INITIALIZER, NULL }
+#endif
 
 /*
  * Spinlock functions.
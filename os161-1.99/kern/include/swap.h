@@ -0,0 +1,37 @@
+#ifndef _SWAP_H_
+#define _SWAP_H_
+
+/*
+ * Swap space for the VM system.
+ *
+ * Pages evicted from memory are written to page-sized slots on a raw
+ * disk device. The slot bitmap lives in memory only; swap contents do
+ * not survive a reboot.
+ *
+ *    swap_bootstrap - open SWAP_DEVICE and size the slot map. Returns
+ *                     an error (and leaves swap disabled) if there is
+ *                     no such device.
+ *
+ *    swap_alloc     - reserve a free slot. Returns ENOSPC if swap is
+ *                     full or disabled.
+ *
+ *    swap_free      - release a slot.
+ *
+ *    swap_out       - write the page at physical address PADDR to SLOT.
+ *
+ *    swap_in        - read SLOT into the page at physical address PADDR.
+ *
+ * swap_out and swap_in do disk I/O and so may sleep.
+ */
+
+#include <types.h>
+
+#define SWAP_DEVICE "lhd1raw:"
+
+int  swap_bootstrap(void);
+int  swap_alloc(unsigned *slot);
+void swap_free(unsigned slot);
+int  swap_out(paddr_t paddr, unsigned slot);
+int  swap_in(paddr_t paddr, unsigned slot);
+
+#endif /* _SWAP_H_ */
@@ -47,6 +47,9 @@ struct semaphore {
 	struct wchan *sem_wchan;
 	struct spinlock sem_lock;
         volatile int sem_count;
+#if OPT_LOCKSTATS
+	struct lockprof sem_prof;	/* contention profile */
+#endif
 };
 
 struct semaphore *sem_create(const char *name, int initial_count);
@@ -70,13 +73,22 @@ void V(struct semaphore *);
  *
  * The name field is for easier debugging. A copy of the name is
  * (should be) made internally.
+ *
+ * Locks are adaptive: a thread that finds the lock held spins for a
+ * while if the holder is running on another cpu, and sleeps only if
+ * the holder is not running or the spin budget runs out. On release
+ * the lock is handed directly to the first sleeper, if any, so a
+ * sleeper cannot be overtaken by spinners.
  */
 struct lock {
         char *lk_name;
-        volatile struct thread *lk_thread;
+        volatile struct thread *volatile lk_thread;
 	volatile int held;
 	struct spinlock lk_lock;
 	struct wchan *lk_wchan;
+#if OPT_LOCKSTATS
+	struct lockprof lk_prof;	/* contention profile */
+#endif
 	// add what you need here
         // (don't forget to mark things volatile as needed)
 };
@@ -99,6 +111,19 @@ void lock_release(struct lock *);
 bool lock_do_i_hold(struct lock *);
 void lock_destroy(struct lock *);
 
+/*
+ * How contended acquires were resolved, summed over all locks and all
+ * cpus. Each cpu counts its own, so lock_getstats gives a snapshot
+ * that is only exact when no locks are in use; it is meant for
+ * benchmarks.
+ */
+struct lock_stats {
+	unsigned ls_spun;	/* got the lock by spinning */
+	unsigned ls_slept;	/* had to sleep at least once */
+	unsigned ls_handoffs;	/* releases that handed off to a sleeper */
+};
+void lock_getstats(struct lock_stats *ls);
+
 
 /*
  * Condition variable.
@@ -143,4 +168,52 @@ void cv_signal(struct cv *cv, struct lock *lock);
 void cv_broadcast(struct cv *cv, struct lock *lock);
 
 
+/*
+ * Reader-writer lock.
+ *
+ * Any number of readers may hold the lock at once, or a single
+ * writer. Writers are preferred: once a writer is waiting, new
+ * readers block until it has been through, so a steady stream of
+ * readers cannot starve it out. (A consequence is that a thread
+ * that already holds the lock for reading must not try to get it for
+ * reading again.)
+ *
+ * The name field is for easier debugging. A copy of the name is
+ * made internally.
+ */
+struct rwlock {
+	char *rw_name;
+	struct spinlock rw_lock;
+	struct wchan *rw_rwchan;	/* readers wait here */
+	struct wchan *rw_wwchan;	/* writers wait here */
+	volatile unsigned rw_readers;	/* readers holding the lock */
+	volatile unsigned rw_wwaiting;	/* writers waiting for it */
+	struct thread *volatile rw_writer;	/* writer holding it, if any */
+};
+
+struct rwlock *rwlock_create(const char *name);
+void rwlock_destroy(struct rwlock *);
+
+/*
+ * Operations:
+ *    rwlock_acquire_read  - Get the lock for reading. Blocks while a
+ *                           writer holds or is waiting for the lock.
+ *    rwlock_release_read  - Give up a read hold.
+ *    rwlock_acquire_write - Get the lock for writing. Blocks until no
+ *                           reader or writer holds it.
+ *    rwlock_release_write - Give up the write hold. Only the thread
+ *                           holding the lock for writing may do this.
+ *    rwlock_do_i_hold_write - Return true if the current thread holds
+ *                           the lock for writing; false otherwise.
+ *
+ * There is no way to ask whether the current thread holds the lock
+ * for reading, since readers are not tracked individually.
+ */
+void rwlock_acquire_read(struct rwlock *);
+void rwlock_release_read(struct rwlock *);
+void rwlock_acquire_write(struct rwlock *);
+void rwlock_release_write(struct rwlock *);
+bool rwlock_do_i_hold_write(struct rwlock *);
+
+
 #endif /* _SYNCH_H_ */
@@ -56,9 +56,13 @@ int queuetest(int, char **);
 int threadtest(int, char **);
 int threadtest2(int, char **);
 int threadtest3(int, char **);
+int schedbench(int, char **);
+int threadbench(int, char **);
 int semtest(int, char **);
 int locktest(int, char **);
 int cvtest(int, char **);
+int rwtest(int, char **);
+int spinbench(int, char **);
 
 #ifdef UW
 /* Another thread and synchronization test */
@@ -78,6 +82,8 @@ int printfile(int, char **);
 /* other tests */
 int malloctest(int, char **);
 int mallocstress(int, char **);
+int mallocbench(int, char **);
+int pagebench(int, char **);
 int nettest(int, char **);
 
 /* Routine for running a user-level program. */
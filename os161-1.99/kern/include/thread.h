@@ -46,6 +46,9 @@ struct cpu;
 #include <machine/thread.h>
 
 
+/* Thread names shorter than this are kept in the thread itself */
+#define THREAD_NAMELEN 16
+
 /* Size of kernel stacks; must be power of 2 */
 #define STACK_SIZE 4096
 
@@ -71,6 +74,7 @@ struct thread {
 	 * debugger is messed up.
 	 */
 	char *t_name;			/* Name of this thread */
+	char t_namebuf[THREAD_NAMELEN];	/* Storage for t_name, if short */
 	const char *t_wchan_name;	/* Name of wait channel, if sleeping */
 	threadstate_t t_state;		/* State this thread is in */
 
@@ -84,6 +88,15 @@ struct thread {
 	struct cpu *t_cpu;		/* CPU thread runs on */
 	struct proc *t_proc;		/* Process thread belongs to */
 
+	/*
+	 * Scheduler fields. See the multilevel feedback queue notes
+	 * in thread.c.
+	 */
+	unsigned t_prio;		/* Queue level; 0 is highest */
+	unsigned t_quantum;		/* Hardclocks left in this slice */
+	unsigned t_lastrun;		/* t_cpu's hardclock count when last
+					   switched out (for affinity) */
+
 	/*
 	 * Interrupt state fields.
 	 *
@@ -157,14 +170,21 @@ void thread_exit(void);
  */
 void thread_yield(void);
 
+/*
+ * Charge a clock tick to the current thread, and give up the cpu if
+ * its quantum has run out or a higher-priority thread is waiting.
+ * Called from the timer interrupt.
+ */
+void thread_timeslice(void);
+
 /*
  * Reshuffle the run queue. Called from the timer interrupt.
  */
 void schedule(void);
 
 /*
- * Potentially migrate ready threads to other CPUs. Called from the
- * timer interrupt.
+ * Potentially pull ready threads over from busier CPUs. Called from
+ * the timer interrupt.
  */
 void thread_consider_migration(void);
 
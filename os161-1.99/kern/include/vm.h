@@ -55,6 +55,15 @@ int vm_fault(int faulttype, vaddr_t faultaddress);
 vaddr_t alloc_kpages(int npages);
 void free_kpages(vaddr_t addr);
 
+/* Print per-cpu frame cache hit rates */
+void vm_printframestats(void);
+
+/* Print TLB shootdown counts and latency */
+void vm_printtlbstats(void);
+
+/* Pre-zero a free frame; called from the idle loop */
+void vm_zero_idle(void);
+
 /* TLB shootdown handling called from interprocessor_interrupt */
 void vm_tlbshootdown_all(void);
 void vm_tlbshootdown(const struct tlbshootdown *);
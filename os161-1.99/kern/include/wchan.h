@@ -44,6 +44,12 @@ struct wchan; /* Opaque */
  */
 struct wchan *wchan_create(const char *name);
 
+/*
+ * Change the symbolic name of a wait channel, for objects that keep
+ * their wchan across reuse. Same rules for NAME as wchan_create.
+ */
+void wchan_setname(struct wchan *wc, const char *name);
+
 /*
  * Destroy a wait channel. Must be empty and unlocked.
  */
@@ -77,8 +83,12 @@ void wchan_sleep(struct wchan *wc);
  *
  * The current implementation is FIFO but this is not promised by the
  * interface.
+ *
+ * wchan_wakeone returns the thread it woke, or NULL if nobody was
+ * sleeping; the caller may use it to hand something directly to that
+ * thread as long as it holds a lock the thread must take on waking.
  */
-void wchan_wakeone(struct wchan *wc);
+struct thread *wchan_wakeone(struct wchan *wc);
 void wchan_wakeall(struct wchan *wc);
 
 
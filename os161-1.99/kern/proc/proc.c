@@ -43,6 +43,8 @@
  */
 
 #include <types.h>
+#include <lib.h>
+#include <kmem.h>
 #include <proc.h>
 #include <current.h>
 #include <addrspace.h>
@@ -56,6 +58,10 @@
  * The process for the kernel; this holds all the kernel-only threads.
  */
 struct proc *kproc;
+
+/* Object cache for proc structures. */
+static struct kmem_cache proc_cache =
+	KMEM_CACHE_INITIALIZER("proc", sizeof(struct proc), NULL, NULL);
 #if OPT_A2
 //volatile struct array *p_table;
 volatile struct proc_combo *p_table;
@@ -81,19 +87,20 @@ proc_create(const char *name)
 {
 	struct proc *proc;
 
-	proc = kmalloc(sizeof(*proc));
+	proc = kmem_cache_alloc(&proc_cache);
 	if (proc == NULL) {
 		return NULL;
 	}
 	proc->p_name = kstrdup(name);
 	if (proc->p_name == NULL) {
-		kfree(proc);
+		kmem_cache_free(&proc_cache, proc);
 		return NULL;
 	}
         #if OPT_A2
         proc->children = array_create();
         if (proc->children == NULL) {
-                kfree(proc);
+                kfree(proc->p_name);
+                kmem_cache_free(&proc_cache, proc);
                 return NULL;
         }
         #endif /* OPT_A2 */
@@ -180,7 +187,7 @@ proc_destroy(struct proc *proc)
 	spinlock_cleanup(&proc->p_lock);
 
 	kfree(proc->p_name);
-	kfree(proc);
+	kmem_cache_free(&proc_cache, proc);
 
 #ifdef UW
 	/* decrement the process count */
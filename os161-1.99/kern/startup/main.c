@@ -49,7 +49,9 @@
 #include <syscall.h>
 #include <test.h>
 #include <version.h>
+#include <uw-vmstats.h>
 #include "autoconf.h"  // for pseudoconfig
+#include "opt-A3.h"
 
 
 /*
@@ -146,6 +148,11 @@ shutdown(void)
 {
 
 	kprintf("Shutting down.\n");
+	#if OPT_A3
+	vmstats_print();
+	vm_printframestats();
+	vm_printtlbstats();
+	#endif /* OPT_A3 */
 	
 	vfs_clearbootfs();
 	vfs_clearcurdir();
@@ -42,10 +42,17 @@
 #include <sfs.h>
 #include <syscall.h>
 #include <test.h>
+#include <vm.h>
 #include "opt-synchprobs.h"
 #include "opt-sfs.h"
 #include "opt-net.h"
 #include "opt-A2.h"
+#include "opt-A3.h"
+#include "opt-kmallocstats.h"
+#include "opt-lockstats.h"
+#if OPT_LOCKSTATS
+#include <lockprof.h>
+#endif
 /*
  * In-kernel menu and command dispatcher.
  */
@@ -411,10 +418,65 @@ cmd_kheapstats(int nargs, char **args)
 	(void)args;	
 
 	kheap_printstats();
+#if OPT_A3
+	vm_printframestats();
+	vm_printtlbstats();
+#endif
 	
 	return 0;
 }
 
+#if OPT_KMALLOCSTATS
+/*
+ * Command for printing the kmalloc size and caller profile;
+ * "khs reset" clears it.
+ */
+static
+int
+cmd_kheapsizes(int nargs, char **args)
+{
+	if (nargs == 2 && !strcmp(args[1], "reset")) {
+		kheap_resetsizes();
+		return 0;
+	}
+	if (nargs != 1) {
+		kprintf("Usage: khs [reset]\n");
+		return EINVAL;
+	}
+
+	kheap_printsizes();
+	return 0;
+}
+#endif
+
+#if OPT_LOCKSTATS
+/*
+ * Command for listing the most contended locks, spinlocks and
+ * semaphores; "lks reset" clears the counters.
+ */
+static
+int
+cmd_lockstats(int nargs, char **args)
+{
+	unsigned n = 10;
+
+	if (nargs == 2 && !strcmp(args[1], "reset")) {
+		lockprof_reset();
+		return 0;
+	}
+	if (nargs == 2) {
+		n = atoi(args[1]);
+	}
+	if (nargs > 2 || n == 0) {
+		kprintf("Usage: lks [n | reset]\n");
+		return EINVAL;
+	}
+
+	lockprof_print(n);
+	return 0;
+}
+#endif
+
 ////////////////////////////////////////
 //
 // Menus.
@@ -475,15 +537,23 @@ static const char *testmenu[] = {
 	"[bt]  Bitmap test                   ",
 	"[km1] Kernel malloc test            ",
 	"[km2] kmalloc stress test           ",
+#if OPT_A3
+	"[km3] Page allocator benchmark      ",
+#endif
+	"[km4] kmalloc scaling benchmark     ",
 	"[tt1] Thread test 1                 ",
 	"[tt2] Thread test 2                 ",
 	"[tt3] Thread test 3                 ",
+	"[tt4] Scheduler balance benchmark   ",
+	"[tt5] Thread create/exit benchmark  ",
 #if OPT_NET
 	"[net] Network test                  ",
 #endif
 	"[sy1] Semaphore test                ",
 	"[sy2] Lock test             (1)     ",
 	"[sy3] CV test               (1)     ",
+	"[sy4] RW lock test          (1)     ",
+	"[sy5] Spinlock benchmark            ",
 #ifdef UW
 	"[uw1] UW lock test          (1)     ",
 	"[uw2] UW vmstats test       (3)     ",
@@ -579,23 +649,37 @@ static struct {
 
 	/* stats */
 	{ "kh",         cmd_kheapstats },
+#if OPT_KMALLOCSTATS
+	{ "khs",        cmd_kheapsizes },
+#endif
+#if OPT_LOCKSTATS
+	{ "lks",        cmd_lockstats },
+#endif
 
 	/* base system tests */
 	{ "at",		arraytest },
 	{ "bt",		bitmaptest },
 	{ "km1",	malloctest },
 	{ "km2",	mallocstress },
+#if OPT_A3
+	{ "km3",	pagebench },
+#endif
+	{ "km4",	mallocbench },
 #if OPT_NET
 	{ "net",	nettest },
 #endif
 	{ "tt1",	threadtest },
 	{ "tt2",	threadtest2 },
 	{ "tt3",	threadtest3 },
+	{ "tt4",	schedbench },
+	{ "tt5",	threadbench },
 	{ "sy1",	semtest },  
 
 	/* synchronization assignment tests */
 	{ "sy2",	locktest },
 	{ "sy3",	cvtest },
+	{ "sy4",	rwtest },
+	{ "sy5",	spinbench },
 #ifdef UW
 	{ "uw1",	uwlocktest1 },
 	{ "uw2",	uwvmstatstest },
@@ -1,6 +1,9 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <kern/unistd.h>
+#include <kern/fcntl.h>
+#include <kern/mman.h>
+#include <limits.h>
 #include <lib.h>
 #include <uio.h>
 #include <syscall.h>
@@ -8,6 +11,9 @@
 #include <vfs.h>
 #include <current.h>
 #include <proc.h>
+#include <addrspace.h>
+#include <copyinout.h>
+#include "opt-A3.h"
 
 /* handler for write() system call                  */
 /*
@@ -58,3 +64,72 @@ sys_write(int fdesc,userptr_t ubuf,unsigned int nbytes,int *retval)
   KASSERT(*retval >= 0);
   return 0;
 }
+
+#if OPT_A3
+/* handler for mmap() system call                   */
+/*
+ * There is no file table yet, so the file is named by path and is
+ * always mapped from offset 0. See kern/mman.h.
+ */
+int
+sys_mmap(userptr_t upath, size_t length, int prot, int flags,
+	 vaddr_t *retval)
+{
+  struct addrspace *as = curproc_getas();
+  struct vnode *v;
+  char *path;
+  off_t size;
+  int res;
+
+  DEBUG(DB_SYSCALL,"Syscall: mmap(%x,%d,%d,%d)\n",
+	(unsigned int)upath,length,prot,flags);
+
+  if (as == NULL) {
+    return ENOMEM;
+  }
+  if ((prot & ~(PROT_READ | PROT_WRITE | PROT_EXEC)) != 0 ||
+      (flags != MAP_SHARED && flags != MAP_PRIVATE) || length == 0) {
+    return EINVAL;
+  }
+
+  path = kmalloc(PATH_MAX);
+  if (path == NULL) {
+    return ENOMEM;
+  }
+  res = copyinstr((const_userptr_t)upath, path, PATH_MAX, NULL);
+  if (res) {
+    kfree(path);
+    return res;
+  }
+  /* writes only reach the file through a shared mapping */
+  res = vfs_open(path,
+		 (flags == MAP_SHARED && (prot & PROT_WRITE)) ? O_RDWR : O_RDONLY,
+		 0, &v);
+  kfree(path);
+  if (res) {
+    return res;
+  }
+
+  res = VOP_MMAP(v, &size);
+  if (res == 0) {
+    res = as_mmap(as, v, length, size, prot, flags == MAP_SHARED, retval);
+  }
+  /* the mapping holds its own reference to v */
+  vfs_close(v);
+  return res;
+}
+
+/* handler for munmap() system call                 */
+int
+sys_munmap(vaddr_t addr, size_t length)
+{
+  struct addrspace *as = curproc_getas();
+
+  DEBUG(DB_SYSCALL,"Syscall: munmap(%x,%d)\n",addr,length);
+
+  if (as == NULL) {
+    return EINVAL;
+  }
+  return as_munmap(as, addr, length);
+}
+#endif /* OPT_A3 */
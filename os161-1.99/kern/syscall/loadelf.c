@@ -59,6 +59,7 @@
 #include <addrspace.h>
 #include <vnode.h>
 #include <elf.h>
+#include "opt-A3.h"
 
 /*
  * Load a segment at virtual address VADDR. The segment in memory
@@ -74,6 +75,7 @@
  * change this code to not use uiomove, be sure to check for this case
  * explicitly.
  */
+#if !(OPT_A3 && AS_LAZYLOAD)
 static
 int
 load_segment(struct addrspace *as, struct vnode *v,
@@ -144,6 +146,7 @@ load_segment(struct addrspace *as, struct vnode *v,
 	
 	return result;
 }
+#endif /* !(OPT_A3 && AS_LAZYLOAD) */
 
 /*
  * Load an ELF executable user program into the current address space.
@@ -243,11 +246,24 @@ load_elf(struct vnode *v, vaddr_t *entrypoint)
 			return ENOEXEC;
 		}
 
+#if OPT_A3
+		if (ph.p_filesz > ph.p_memsz) {
+			kprintf("ELF: warning: segment filesize > segment memsize\n");
+			ph.p_filesz = ph.p_memsz;
+		}
+		result = as_define_region(as,
+					  ph.p_vaddr, ph.p_memsz,
+					  ph.p_flags & PF_R,
+					  ph.p_flags & PF_W,
+					  ph.p_flags & PF_X,
+					  v, ph.p_offset, ph.p_filesz);
+#else
 		result = as_define_region(as,
 					  ph.p_vaddr, ph.p_memsz,
 					  ph.p_flags & PF_R,
 					  ph.p_flags & PF_W,
 					  ph.p_flags & PF_X);
+#endif /* OPT_A3 */
 		if (result) {
 			return result;
 		}
@@ -258,6 +274,13 @@ load_elf(struct vnode *v, vaddr_t *entrypoint)
 		return result;
 	}
 
+#if OPT_A3 && AS_LAZYLOAD
+	/*
+	 * Nothing to read now; vm_fault brings each page in from V
+	 * when it is first touched.
+	 */
+#else
+
 	/*
 	 * Now actually load each segment.
 	 */
@@ -295,6 +318,7 @@ load_elf(struct vnode *v, vaddr_t *entrypoint)
 			return result;
 		}
 	}
+#endif /* OPT_A3 && AS_LAZYLOAD */
 
 	result = as_complete_load(as);
 	if (result) {
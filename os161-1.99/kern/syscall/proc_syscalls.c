@@ -11,6 +11,7 @@
 #include <addrspace.h>
 #include <copyinout.h>
 #include "opt-A2.h"
+#include "opt-A3.h"
 #include <mips/trapframe.h>
 #include <synch.h>
 #include <array.h>
@@ -274,3 +275,17 @@ sys_waitpid(pid_t pid,
   return(0);
 }
 
+
+#if OPT_A3
+/* handler for sbrk() system call; the heap itself is managed by the VM */
+int
+sys_sbrk(intptr_t amount, vaddr_t *retval)
+{
+  struct addrspace *as = curproc_getas();
+
+  if (as == NULL) {
+    return ENOMEM;
+  }
+  return as_sbrk(as, amount, retval);
+}
+#endif /* OPT_A3 */
@@ -31,10 +31,15 @@
  * Test code for kmalloc.
  */
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
 #include <thread.h>
 #include <synch.h>
 #include <test.h>
+#include <clock.h>
+#include <cpu.h>
+#include <vm.h>
+#include "opt-A3.h"
 
 /*
  * Test kmalloc; allocate ITEMSIZE bytes NTRIES times, freeing
@@ -137,3 +142,215 @@ mallocstress(int nargs, char **args)
 
 	return 0;
 }
+
+/*
+ * Measure how kmalloc/kfree throughput scales with the number of
+ * threads, doubling from 1 up to the number of cpus (or the count
+ * given as an argument). Each thread cycles through a mix of subpage
+ * sizes, keeping MB_WINDOW blocks live so that frees land on the
+ * same cpu's magazines as well as on other threads' blocks.
+ */
+
+#define MB_ITERS   4000
+#define MB_WINDOW  8
+
+static const size_t mb_sizes[] = { 12, 24, 40, 100, 200, 400, 900, 1500 };
+#define MB_NSIZES (sizeof(mb_sizes) / sizeof(mb_sizes[0]))
+
+static volatile bool mb_failed;
+
+static
+void
+mallocbenchthread(void *sm, unsigned long num)
+{
+	struct semaphore *sem = sm;
+	void *held[MB_WINDOW];
+	unsigned i, slot;
+
+	for (i=0; i<MB_WINDOW; i++) {
+		held[i] = NULL;
+	}
+
+	for (i=0; i<MB_ITERS; i++) {
+		slot = i % MB_WINDOW;
+		kfree(held[slot]);
+		held[slot] = kmalloc(mb_sizes[(i + num) % MB_NSIZES]);
+		if (held[slot] == NULL) {
+			mb_failed = true;
+			break;
+		}
+	}
+
+	for (i=0; i<MB_WINDOW; i++) {
+		kfree(held[i]);
+	}
+	V(sem);
+}
+
+int
+mallocbench(int nargs, char **args)
+{
+	struct semaphore *sem;
+	unsigned maxthreads, nthreads, i;
+	time_t s1, s2, secs;
+	uint32_t ns1, ns2, nsecs;
+	uint64_t usecs, ops, rate, baserate = 0;
+	int result;
+
+	maxthreads = cpu_count();
+	if (nargs > 1) {
+		maxthreads = atoi(args[1]);
+		if (maxthreads == 0) {
+			kprintf("Usage: km4 [maxthreads]\n");
+			return EINVAL;
+		}
+	}
+
+	sem = sem_create("mallocbench", 0);
+	if (sem == NULL) {
+		panic("mallocbench: sem_create failed\n");
+	}
+
+	kprintf("Starting kmalloc scaling benchmark (%u cpus)...\n",
+		cpu_count());
+	mb_failed = false;
+
+	for (nthreads=1; nthreads<=maxthreads; nthreads*=2) {
+		gettime(&s1, &ns1);
+		for (i=0; i<nthreads; i++) {
+			result = thread_fork("mallocbench", NULL,
+					     mallocbenchthread, sem, i);
+			if (result) {
+				panic("mallocbench: thread_fork failed: %s\n",
+				      strerror(result));
+			}
+		}
+		for (i=0; i<nthreads; i++) {
+			P(sem);
+		}
+		gettime(&s2, &ns2);
+
+		if (mb_failed) {
+			kprintf("mallocbench: kmalloc returned NULL\n");
+			break;
+		}
+
+		getinterval(s1, ns1, s2, ns2, &secs, &nsecs);
+		usecs = (uint64_t)secs * 1000000 + nsecs / 1000;
+		if (usecs == 0) {
+			usecs = 1;
+		}
+		/* a kmalloc and a kfree per iteration */
+		ops = (uint64_t)nthreads * MB_ITERS * 2;
+		rate = ops * 1000000 / usecs;
+		if (baserate == 0) {
+			baserate = rate;
+		}
+		kprintf("%3u threads: %7lu ops in %lu.%06lu s: "
+			"%lu ops/sec (%lu.%02lux)\n", nthreads,
+			(unsigned long)ops, (unsigned long)secs,
+			(unsigned long)(nsecs / 1000), (unsigned long)rate,
+			(unsigned long)(rate / baserate),
+			(unsigned long)(rate * 100 / baserate % 100));
+	}
+
+	sem_destroy(sem);
+	kheap_printstats();
+	kprintf("kmalloc scaling benchmark done\n");
+
+	return 0;
+}
+
+#if OPT_A3
+/*
+ * Benchmark the page frame allocator: alloc_kpages/free_kpages
+ * pairs, batches of single pages held at once (so frees land next to
+ * each other and coalesce), and short multi-page runs.
+ */
+
+#define PB_ITERS   4000	/* keeps PB_ITERS * 1000000 in 32 bits */
+#define PB_BATCH   64
+#define PB_RUN     4
+
+static
+void
+pagebench_report(const char *what, unsigned nallocs,
+		 time_t s1, uint32_t ns1, time_t s2, uint32_t ns2)
+{
+	time_t secs;
+	uint32_t nsecs, usecs;
+
+	getinterval(s1, ns1, s2, ns2, &secs, &nsecs);
+	usecs = secs * 1000000 + nsecs / 1000;
+	if (usecs == 0) {
+		usecs = 1;
+	}
+	kprintf("%-12s %6u allocs in %lu.%06lu s: %u allocs/sec\n",
+		what, nallocs, (unsigned long)secs,
+		(unsigned long)(nsecs / 1000),
+		nallocs * 1000000 / usecs);
+}
+
+int
+pagebench(int nargs, char **args)
+{
+	vaddr_t pages[PB_BATCH];
+	time_t s1, s2;
+	uint32_t ns1, ns2;
+	unsigned i, j, n;
+
+	(void)nargs;
+	(void)args;
+
+	kprintf("Starting page allocator benchmark...\n");
+
+	gettime(&s1, &ns1);
+	for (i=0; i<PB_ITERS; i++) {
+		pages[0] = alloc_kpages(1);
+		if (pages[0] == 0) {
+			kprintf("pagebench: out of memory\n");
+			return ENOMEM;
+		}
+		free_kpages(pages[0]);
+	}
+	gettime(&s2, &ns2);
+	pagebench_report("single", PB_ITERS, s1, ns1, s2, ns2);
+
+	n = 0;
+	gettime(&s1, &ns1);
+	for (i=0; i<PB_ITERS/PB_BATCH; i++) {
+		for (j=0; j<PB_BATCH; j++) {
+			pages[j] = alloc_kpages(1);
+			if (pages[j] == 0) {
+				break;
+			}
+		}
+		n += j;
+		while (j-- > 0) {
+			free_kpages(pages[j]);
+		}
+	}
+	gettime(&s2, &ns2);
+	pagebench_report("batch", n, s1, ns1, s2, ns2);
+
+	n = 0;
+	gettime(&s1, &ns1);
+	for (i=0; i<PB_ITERS/PB_BATCH; i++) {
+		for (j=0; j<PB_BATCH/PB_RUN; j++) {
+			pages[j] = alloc_kpages(PB_RUN);
+			if (pages[j] == 0) {
+				break;
+			}
+		}
+		n += j;
+		while (j-- > 0) {
+			free_kpages(pages[j]);
+		}
+	}
+	gettime(&s2, &ns2);
+	pagebench_report("4-page runs", n, s1, ns1, s2, ns2);
+
+	kprintf("page allocator benchmark done\n");
+	return 0;
+}
+#endif /* OPT_A3 */
@@ -32,8 +32,13 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
 #include <clock.h>
+#include <cpu.h>
+#include <spl.h>
+#include <spinlock.h>
+#include <current.h>
 #include <thread.h>
 #include <synch.h>
 #include <test.h>
@@ -41,6 +46,9 @@
 #define NSEMLOOPS     63
 #define NLOCKLOOPS    120
 #define NCVLOOPS      5
+#define NRWLOOPS      200
+#define NRWDATA       16
+#define RWWRITERS     4   /* one thread in RWWRITERS is a writer */
 #define NTHREADS      32
 
 static volatile unsigned long testval1;
@@ -68,6 +76,10 @@ cleanitems(void)
 	lock_destroy(testlock);
 	cv_destroy(testcv);
 	sem_destroy(donesem);
+	testsem = NULL;
+	testlock = NULL;
+	testcv = NULL;
+	donesem = NULL;
 	}
 #endif
 
@@ -229,6 +241,9 @@ int
 locktest(int nargs, char **args)
 {
 	int i, result;
+	struct lock_stats before, after;
+	time_t secs1, secs2;
+	uint32_t nsecs1, nsecs2;
 
 	(void)nargs;
 	(void)args;
@@ -236,6 +251,9 @@ locktest(int nargs, char **args)
 	inititems();
 	kprintf("Starting lock test...\n");
 
+	lock_getstats(&before);
+	gettime(&secs1, &nsecs1);
+
 	for (i=0; i<NTHREADS; i++) {
 		result = thread_fork("synchtest", NULL, locktestthread,
 				     NULL, i);
@@ -247,6 +265,14 @@ locktest(int nargs, char **args)
 	for (i=0; i<NTHREADS; i++) {
 		P(donesem);
 	}
+	gettime(&secs2, &nsecs2);
+	lock_getstats(&after);
+	getinterval(secs1, nsecs1, secs2, nsecs2, &secs2, &nsecs2);
+	kprintf("%lu.%09lu seconds; %u spun, %u slept, %u handoffs\n",
+		(unsigned long) secs2, (unsigned long) nsecs2,
+		after.ls_spun - before.ls_spun,
+		after.ls_slept - before.ls_slept,
+		after.ls_handoffs - before.ls_handoffs);
 
 #ifdef UW
   cleanitems();
@@ -347,3 +373,304 @@ cvtest(int nargs, char **args)
 
 	return 0;
 }
+
+/*
+ * Reader-writer lock test. Most threads read a shared array and check
+ * that every slot holds the same value; every RWWRITERS'th thread
+ * rewrites the whole array, yielding halfway through so that a reader
+ * let in at the wrong time would see it half-written. The number of
+ * readers inside at once is tracked to show that reads do overlap and
+ * that writers are alone.
+ */
+
+static struct rwlock *testrw;
+static volatile unsigned long rwdata[NRWDATA];
+static struct spinlock rwstat_lock = SPINLOCK_INITIALIZER;
+static volatile unsigned rw_inside, rw_maxinside;
+static volatile unsigned rw_nreads, rw_nwrites;
+static volatile bool rw_failed;
+
+static
+void
+rwtestthread(void *junk, unsigned long num)
+{
+	unsigned long val;
+	int i, j;
+	(void)junk;
+
+	for (i=0; i<NRWLOOPS; i++) {
+		if (num % RWWRITERS == 0) {
+			rwlock_acquire_write(testrw);
+			KASSERT(rwlock_do_i_hold_write(testrw));
+			if (rw_inside != 0) {
+				kprintf("thread %lu: writer overlaps %u "
+					"readers\n", num, rw_inside);
+				rw_failed = true;
+			}
+			val = rwdata[0] + 1;
+			for (j=0; j<NRWDATA; j++) {
+				rwdata[j] = val;
+				if (j == NRWDATA/2) {
+					thread_yield();
+				}
+			}
+			rw_nwrites++;
+			rwlock_release_write(testrw);
+		}
+		else {
+			rwlock_acquire_read(testrw);
+			spinlock_acquire(&rwstat_lock);
+			rw_inside++;
+			if (rw_inside > rw_maxinside) {
+				rw_maxinside = rw_inside;
+			}
+			rw_nreads++;
+			spinlock_release(&rwstat_lock);
+
+			val = rwdata[0];
+			thread_yield();
+			for (j=0; j<NRWDATA; j++) {
+				if (rwdata[j] != val) {
+					kprintf("thread %lu: Mismatch on "
+						"rwdata[%d]\n", num, j);
+					rw_failed = true;
+				}
+			}
+
+			spinlock_acquire(&rwstat_lock);
+			rw_inside--;
+			spinlock_release(&rwstat_lock);
+			rwlock_release_read(testrw);
+		}
+	}
+	V(donesem);
+#ifdef UW
+  thread_exit();
+#endif
+}
+
+int
+rwtest(int nargs, char **args)
+{
+	int i, result;
+
+	(void)nargs;
+	(void)args;
+
+	inititems();
+	testrw = rwlock_create("testrw");
+	if (testrw == NULL) {
+		panic("rwtest: rwlock_create failed\n");
+	}
+	for (i=0; i<NRWDATA; i++) {
+		rwdata[i] = 0;
+	}
+	rw_inside = rw_maxinside = 0;
+	rw_nreads = rw_nwrites = 0;
+	rw_failed = false;
+	kprintf("Starting RW lock test...\n");
+
+	for (i=0; i<NTHREADS; i++) {
+		result = thread_fork("synchtest", NULL, rwtestthread,
+				     NULL, i);
+		if (result) {
+			panic("rwtest: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	for (i=0; i<NTHREADS; i++) {
+		P(donesem);
+	}
+
+	kprintf("%u reads, %u writes, at most %u readers at once\n",
+		rw_nreads, rw_nwrites, rw_maxinside);
+	if (rwdata[0] != rw_nwrites) {
+		kprintf("Lost writes: data %lu, writes %u\n",
+			rwdata[0], rw_nwrites);
+		rw_failed = true;
+	}
+	if (rw_failed) {
+		kprintf("Test failed\n");
+	}
+
+	rwlock_destroy(testrw);
+	testrw = NULL;
+#ifdef UW
+  cleanitems();
+#endif
+	kprintf("RW lock test done\n");
+
+	return 0;
+}
+
+/*
+ * Spinlock benchmark. One thread per cpu hammers a single spinlock for
+ * a few seconds, doing a little work inside and outside the critical
+ * section, first with a plain test-and-test-and-set lock (what struct
+ * spinlock used to be) and then with struct spinlock itself. Reports
+ * acquisitions per second and how evenly they were spread across the
+ * cpus; an unfair lock shows up as a large standard deviation.
+ */
+
+#define SPINBENCH_SECS  2
+#define SPINBENCH_WORK  20
+
+static struct spinlock sb_lock = SPINLOCK_INITIALIZER;
+static volatile spinlock_data_t sb_ttas = SPINLOCK_DATA_INITIALIZER;
+static bool sb_useticket;
+static volatile bool sb_stop;
+static unsigned long *sb_counts;	/* acquisitions, per cpu */
+static volatile unsigned long sb_shared;
+
+static
+void
+sb_thread(void *junk, unsigned long num)
+{
+	volatile unsigned j;
+	int s = 0;
+
+	(void)junk;
+	(void)num;
+
+	while (!sb_stop) {
+		if (sb_useticket) {
+			spinlock_acquire(&sb_lock);
+		}
+		else {
+			s = splhigh();
+			while (spinlock_data_get(&sb_ttas) != 0 ||
+			       spinlock_data_testandset(&sb_ttas) != 0) {
+				/* spin */
+			}
+		}
+
+		sb_counts[curcpu->c_number]++;
+		for (j=0; j<SPINBENCH_WORK; j++) {
+			sb_shared++;
+		}
+
+		if (sb_useticket) {
+			spinlock_release(&sb_lock);
+		}
+		else {
+			spinlock_data_set(&sb_ttas, 0);
+			splx(s);
+		}
+
+		for (j=0; j<SPINBENCH_WORK; j++) {
+			/* think */
+		}
+	}
+	V(donesem);
+#ifdef UW
+  thread_exit();
+#endif
+}
+
+static
+uint64_t
+sb_isqrt(uint64_t x)
+{
+	uint64_t lo = 0, hi = 0xffffffff, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo + 1) / 2;
+		if (mid * mid <= x) {
+			lo = mid;
+		}
+		else {
+			hi = mid - 1;
+		}
+	}
+	return lo;
+}
+
+static
+void
+sb_run(const char *what, bool ticket, unsigned secs, unsigned ncpus)
+{
+	unsigned long total, min, max, mean;
+	uint64_t var, dev;
+	unsigned i;
+	int result;
+
+	for (i=0; i<ncpus; i++) {
+		sb_counts[i] = 0;
+	}
+	sb_useticket = ticket;
+	sb_stop = false;
+
+	for (i=0; i<ncpus; i++) {
+		result = thread_fork("spinbench", NULL, sb_thread, NULL, i);
+		if (result) {
+			panic("spinbench: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	clocksleep(secs);
+	sb_stop = true;
+	for (i=0; i<ncpus; i++) {
+		P(donesem);
+	}
+
+	total = max = 0;
+	min = (unsigned long)-1;
+	for (i=0; i<ncpus; i++) {
+		total += sb_counts[i];
+		if (sb_counts[i] < min) {
+			min = sb_counts[i];
+		}
+		if (sb_counts[i] > max) {
+			max = sb_counts[i];
+		}
+	}
+	mean = total / ncpus;
+	var = 0;
+	for (i=0; i<ncpus; i++) {
+		dev = sb_counts[i] > mean ?
+			sb_counts[i] - mean : mean - sb_counts[i];
+		var += dev * dev;
+	}
+	var /= ncpus;
+	dev = sb_isqrt(var);
+
+	kprintf("%-6s %lu acquires/sec; per cpu mean %lu, min %lu, max %lu, "
+		"stddev %lu (%lu%% of mean)\n", what, total / secs,
+		mean, min, max, (unsigned long)dev,
+		mean ? (unsigned long)(dev * 100 / mean) : 0);
+}
+
+int
+spinbench(int nargs, char **args)
+{
+	unsigned secs, ncpus;
+
+	secs = SPINBENCH_SECS;
+	if (nargs > 1) {
+		secs = atoi(args[1]);
+	}
+	if (nargs > 2 || secs == 0) {
+		kprintf("Usage: sy5 [seconds]\n");
+		return EINVAL;
+	}
+
+	inititems();
+	ncpus = cpu_count();
+	sb_counts = kmalloc(ncpus * sizeof(*sb_counts));
+	if (sb_counts == NULL) {
+		return ENOMEM;
+	}
+	kprintf("Starting spinlock benchmark (%u cpus, %u seconds each)...\n",
+		ncpus, secs);
+
+	sb_run("ttas", false, secs, ncpus);
+	sb_run("ticket", true, secs, ncpus);
+
+	kfree(sb_counts);
+	sb_counts = NULL;
+#ifdef UW
+  cleanitems();
+#endif
+	kprintf("Spinlock benchmark done\n");
+	return 0;
+}
@@ -31,7 +31,10 @@
  * Thread test code.
  */
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
+#include <clock.h>
+#include <cpu.h>
 #include <thread.h>
 #include <synch.h>
 #include <test.h>
@@ -144,3 +147,88 @@ threadtest2(int nargs, char **args)
 
 	return 0;
 }
+
+/*
+ * Thread create/exit throughput: fork TB_BATCH threads that exit at
+ * once, wait for them, and repeat. Reports threads per second and how
+ * often thread_fork could reuse a reaped thread and its stack.
+ */
+
+#define TB_THREADS  2000
+#define TB_BATCH    NTHREADS
+
+static
+void
+tb_thread(void *junk, unsigned long num)
+{
+	(void)junk;
+	(void)num;
+	V(tsem);
+}
+
+int
+threadbench(int nargs, char **args)
+{
+	unsigned nthreads, i, j, ncpus;
+	unsigned hits, misses;
+	time_t s1, s2, secs;
+	uint32_t ns1, ns2, nsecs;
+	uint64_t usecs;
+	struct cpu *c;
+	int result;
+
+	nthreads = TB_THREADS;
+	if (nargs > 1) {
+		nthreads = atoi(args[1]);
+	}
+	if (nargs > 2 || nthreads == 0) {
+		kprintf("Usage: tt5 [nthreads]\n");
+		return EINVAL;
+	}
+
+	init_sem();
+	ncpus = cpu_count();
+	hits = misses = 0;
+	for (i=0; i<ncpus; i++) {
+		c = cpu_get(i);
+		hits -= c->c_threadcache_hits;
+		misses -= c->c_threadcache_misses;
+	}
+
+	kprintf("Starting thread create/exit benchmark (%u threads)...\n",
+		nthreads);
+	gettime(&s1, &ns1);
+	for (i=0; i<nthreads; i+=TB_BATCH) {
+		for (j=0; j<TB_BATCH && i+j<nthreads; j++) {
+			result = thread_fork("tb", NULL, tb_thread,
+					     NULL, i+j);
+			if (result) {
+				panic("threadbench: thread_fork failed: %s\n",
+				      strerror(result));
+			}
+		}
+		while (j-- > 0) {
+			P(tsem);
+		}
+	}
+	gettime(&s2, &ns2);
+
+	for (i=0; i<ncpus; i++) {
+		c = cpu_get(i);
+		hits += c->c_threadcache_hits;
+		misses += c->c_threadcache_misses;
+	}
+
+	getinterval(s1, ns1, s2, ns2, &secs, &nsecs);
+	usecs = (uint64_t)secs * 1000000 + nsecs / 1000;
+	if (usecs == 0) {
+		usecs = 1;
+	}
+	kprintf("%u threads in %lu.%06lu s: %lu threads/sec\n", nthreads,
+		(unsigned long)secs, (unsigned long)(nsecs / 1000),
+		(unsigned long)((uint64_t)nthreads * 1000000 / usecs));
+	kprintf("thread cache: %u reused, %u created (%u%%)\n", hits, misses,
+		hits + misses ? hits * 100 / (hits + misses) : 0);
+	kprintf("Thread create/exit benchmark done\n");
+	return 0;
+}
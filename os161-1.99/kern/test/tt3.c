@@ -31,7 +31,10 @@
  * More thread test code.
  */
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
+#include <clock.h>
+#include <cpu.h>
 #include <wchan.h>
 #include <thread.h>
 #include <synch.h>
@@ -266,3 +269,129 @@ threadtest3(int nargs, char **args)
 	}
 	return 0;
 }
+
+/*
+ * Scheduler load-balancing benchmark: run a batch of pure compute
+ * threads (all forked on this cpu) and report, per cpu, how busy it
+ * was and how many threads it stole or lost to stealing. Run under
+ * sys161 configurations with different cpu counts to compare.
+ */
+
+#define SB_LOOPS 2000000
+
+struct sb_snap {
+	unsigned clocks, idle, steals, stolen;
+};
+
+static
+void
+sb_snapshot(struct sb_snap *snap, unsigned ncpus)
+{
+	struct cpu *c;
+	unsigned i;
+
+	for (i=0; i<ncpus; i++) {
+		c = cpu_get(i);
+		snap[i].clocks = c->c_hardclocks;
+		snap[i].idle = c->c_idleclocks;
+		snap[i].steals = c->c_steals;
+		snap[i].stolen = c->c_stolen;
+	}
+}
+
+static
+void
+sb_thread(void *sem, unsigned long loops)
+{
+	volatile unsigned long i;
+
+	for (i=0; i<loops; i++) {
+		/* spin */
+	}
+	V((struct semaphore *)sem);
+}
+
+int
+schedbench(int nargs, char **args)
+{
+	struct semaphore *sem;
+	struct sb_snap *before, *after;
+	unsigned ncpus, nthreads, i;
+	unsigned clocks, idle, steals, stolen, totclocks, totidle;
+	unsigned long loops;
+	time_t s1, s2, secs;
+	uint32_t ns1, ns2, nsecs;
+	char name[16];
+	int result;
+
+	ncpus = cpu_count();
+	nthreads = 2 * ncpus;
+	loops = SB_LOOPS;
+	if (nargs > 1) {
+		nthreads = atoi(args[1]);
+	}
+	if (nargs > 2) {
+		loops = atoi(args[2]);
+	}
+	if (nargs > 3 || nthreads == 0 || loops == 0) {
+		kprintf("Usage: tt4 [nthreads [loops]]\n");
+		return EINVAL;
+	}
+
+	before = kmalloc(ncpus * sizeof(*before));
+	after = kmalloc(ncpus * sizeof(*after));
+	sem = sem_create("schedbench", 0);
+	if (before == NULL || after == NULL || sem == NULL) {
+		kfree(before);
+		kfree(after);
+		if (sem != NULL) {
+			sem_destroy(sem);
+		}
+		return ENOMEM;
+	}
+
+	kprintf("Starting scheduler benchmark: %u compute threads, "
+		"%u cpus\n", nthreads, ncpus);
+
+	sb_snapshot(before, ncpus);
+	gettime(&s1, &ns1);
+	for (i=0; i<nthreads; i++) {
+		snprintf(name, sizeof(name), "sbcompute%u", i);
+		result = thread_fork(name, NULL, sb_thread, sem, loops);
+		if (result) {
+			panic("schedbench: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	for (i=0; i<nthreads; i++) {
+		P(sem);
+	}
+	gettime(&s2, &ns2);
+	sb_snapshot(after, ncpus);
+
+	getinterval(s1, ns1, s2, ns2, &secs, &nsecs);
+	kprintf("Elapsed %lu.%06lu s\n", (unsigned long)secs,
+		(unsigned long)(nsecs / 1000));
+
+	totclocks = totidle = 0;
+	for (i=0; i<ncpus; i++) {
+		clocks = after[i].clocks - before[i].clocks;
+		idle = after[i].idle - before[i].idle;
+		steals = after[i].steals - before[i].steals;
+		stolen = after[i].stolen - before[i].stolen;
+		totclocks += clocks;
+		totidle += idle;
+		kprintf("  cpu%u: %3u%% busy (%u/%u ticks idle), "
+			"stole %u, lost %u\n", i,
+			clocks ? 100 - idle * 100 / clocks : 0,
+			idle, clocks, steals, stolen);
+	}
+	kprintf("  total: %3u%% busy\n",
+		totclocks ? 100 - totidle * 100 / totclocks : 0);
+
+	sem_destroy(sem);
+	kfree(before);
+	kfree(after);
+	kprintf("Scheduler benchmark done\n");
+	return 0;
+}
@@ -7,6 +7,8 @@
  */
 
 #include <types.h>
+#include <lib.h>
+#include <clock.h>
 #include <synch.h>
 #include <thread.h>
 #include <test.h>
@@ -125,6 +127,9 @@ uwlocktest1(int nargs, char **args)
 {
 	int i, result;
   char name[NAME_LEN];
+	struct lock_stats before, after;
+	time_t secs1, secs2;
+	uint32_t nsecs1, nsecs2;
 
 	(void)nargs;
 	(void)args;
@@ -132,6 +137,9 @@ uwlocktest1(int nargs, char **args)
 	inititems();
 	kprintf("Starting uwlocktest1...\n");
 
+	lock_getstats(&before);
+	gettime(&secs1, &nsecs1);
+
 	for (i=0; i<NTESTTHREADS; i++) {
     snprintf(name, NAME_LEN, "add_thread %d", i);
 		result = thread_fork(name, NULL, add_thread, NULL, i);
@@ -153,6 +161,14 @@ uwlocktest1(int nargs, char **args)
 	for (i=0; i<NTESTTHREADS*2; i++) {
 		P(donesem);
 	}
+	gettime(&secs2, &nsecs2);
+	lock_getstats(&after);
+	getinterval(secs1, nsecs1, secs2, nsecs2, &secs2, &nsecs2);
+	kprintf("%lu.%09lu seconds; %u spun, %u slept, %u handoffs\n",
+		(unsigned long) secs2, (unsigned long) nsecs2,
+		after.ls_spun - before.ls_spun,
+		after.ls_slept - before.ls_slept,
+		after.ls_handoffs - before.ls_handoffs);
 
 	kprintf("value of test_value = %d should be %d\n", test_value, START_VALUE);
 	if (test_value == START_VALUE) {
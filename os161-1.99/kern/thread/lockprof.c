@@ -0,0 +1,227 @@
+/*
+ * Lock contention profiling. See lockprof.h.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <cpu.h>
+#include <spl.h>
+#include <spinlock.h>
+#include <lockprof.h>
+
+/*
+ * The list of contended locks. It is guarded with a bare test-and-set
+ * word rather than a struct spinlock, because it is used from inside
+ * spinlock_acquire. Nothing else is ever taken while holding it.
+ */
+static struct lockprof *lockprof_list;
+static volatile spinlock_data_t lockprof_listlock = SPINLOCK_DATA_INITIALIZER;
+
+#define LOCKPROF_MAXTOP  50
+#define LOCKPROF_NAMELEN 20
+
+static
+int
+lockprof_lock(void)
+{
+	int s;
+
+	s = splhigh();
+	while (spinlock_data_get(&lockprof_listlock) != 0 ||
+	       spinlock_data_testandset(&lockprof_listlock) != 0) {
+		/* spin */
+	}
+	return s;
+}
+
+static
+void
+lockprof_unlock(int s)
+{
+	spinlock_data_set(&lockprof_listlock, 0);
+	splx(s);
+}
+
+void
+lockprof_init(struct lockprof *lp, const void *lock, const char *name)
+{
+	lp->lp_name = name;
+	lp->lp_lock = lock;
+	lp->lp_acquires = 0;
+	lp->lp_contended = 0;
+	lp->lp_waittotal = 0;
+	lp->lp_waitmax = 0;
+	lp->lp_holdmax = 0;
+	lp->lp_holdstart = 0;
+	lp->lp_caller = NULL;
+	lp->lp_next = NULL;
+	lp->lp_listed = false;
+}
+
+void
+lockprof_cleanup(struct lockprof *lp)
+{
+	struct lockprof **pp;
+	int s;
+
+	if (!lp->lp_listed) {
+		return;
+	}
+
+	s = lockprof_lock();
+	for (pp = &lockprof_list; *pp != NULL; pp = &(*pp)->lp_next) {
+		if (*pp == lp) {
+			*pp = lp->lp_next;
+			break;
+		}
+	}
+	lp->lp_next = NULL;
+	lp->lp_listed = false;
+	lockprof_unlock(s);
+}
+
+void
+lockprof_acquired(struct lockprof *lp, uint32_t waitstart,
+		  bool contended, const void *caller)
+{
+	uint32_t now, wait;
+	int s;
+
+	now = cpu_cycles();
+	lp->lp_acquires++;
+	lp->lp_holdstart = now;
+	if (!contended) {
+		return;
+	}
+
+	wait = now - waitstart;
+	lp->lp_contended++;
+	lp->lp_waittotal += wait;
+	if (wait > lp->lp_waitmax) {
+		lp->lp_waitmax = wait;
+	}
+	lp->lp_caller = caller;
+
+	if (!lp->lp_listed) {
+		s = lockprof_lock();
+		lp->lp_next = lockprof_list;
+		lockprof_list = lp;
+		lp->lp_listed = true;
+		lockprof_unlock(s);
+	}
+}
+
+void
+lockprof_released(struct lockprof *lp)
+{
+	uint32_t hold;
+
+	hold = cpu_cycles() - lp->lp_holdstart;
+	if (hold > lp->lp_holdmax) {
+		lp->lp_holdmax = hold;
+	}
+}
+
+/*
+ * Snapshot of one listed lock, taken under the list lock so that it
+ * can be printed afterwards even if the lock has gone away.
+ */
+struct lockprof_snap {
+	char ls_name[LOCKPROF_NAMELEN];
+	const void *ls_lock;
+	const void *ls_caller;
+	unsigned ls_acquires;
+	unsigned ls_contended;
+	uint64_t ls_waittotal;
+	uint32_t ls_waitmax;
+	uint32_t ls_holdmax;
+};
+
+void
+lockprof_print(unsigned n)
+{
+	struct lockprof_snap *top;
+	struct lockprof *lp;
+	unsigned ntop, nlisted, i;
+	int s;
+
+	if (n == 0) {
+		return;
+	}
+	if (n > LOCKPROF_MAXTOP) {
+		n = LOCKPROF_MAXTOP;
+	}
+	top = kmalloc(n * sizeof(*top));
+	if (top == NULL) {
+		kprintf("lockprof: out of memory\n");
+		return;
+	}
+
+	/* insertion sort into TOP, most contended first */
+	ntop = nlisted = 0;
+	s = lockprof_lock();
+	for (lp = lockprof_list; lp != NULL; lp = lp->lp_next) {
+		nlisted++;
+		if (ntop == n && lp->lp_contended <= top[n-1].ls_contended) {
+			continue;
+		}
+		i = (ntop < n) ? ntop++ : n-1;
+		while (i > 0 && top[i-1].ls_contended < lp->lp_contended) {
+			top[i] = top[i-1];
+			i--;
+		}
+		snprintf(top[i].ls_name, sizeof(top[i].ls_name), "%s",
+			 lp->lp_name != NULL ? lp->lp_name : "(spinlock)");
+		top[i].ls_lock = lp->lp_lock;
+		top[i].ls_caller = lp->lp_caller;
+		top[i].ls_acquires = lp->lp_acquires;
+		top[i].ls_contended = lp->lp_contended;
+		top[i].ls_waittotal = lp->lp_waittotal;
+		top[i].ls_waitmax = lp->lp_waitmax;
+		top[i].ls_holdmax = lp->lp_holdmax;
+	}
+	lockprof_unlock(s);
+
+	kprintf("%u contended locks; times in cycles\n", nlisted);
+	kprintf("%-19s %10s %9s %9s %9s %9s  %s / %s\n",
+		"name", "acquires", "contended", "avg wait", "max wait",
+		"max hold", "lock", "last caller");
+	for (i=0; i<ntop; i++) {
+		kprintf("%-19s %10u %9u %9lu %9u %9u  %p / %p\n",
+			top[i].ls_name, top[i].ls_acquires,
+			top[i].ls_contended,
+			top[i].ls_contended == 0 ? 0 :
+			(unsigned long)(top[i].ls_waittotal /
+					top[i].ls_contended),
+			top[i].ls_waitmax, top[i].ls_holdmax,
+			top[i].ls_lock, top[i].ls_caller);
+	}
+
+	kfree(top);
+}
+
+void
+lockprof_reset(void)
+{
+	struct lockprof *lp, *next;
+	int s;
+
+	/*
+	 * Only listed locks are zeroed. A lock that has never been
+	 * contended keeps its acquisition count, which shows up if it
+	 * is contended later.
+	 */
+	s = lockprof_lock();
+	for (lp = lockprof_list; lp != NULL; lp = next) {
+		next = lp->lp_next;
+		lp->lp_acquires = 0;
+		lp->lp_contended = 0;
+		lp->lp_waittotal = 0;
+		lp->lp_waitmax = 0;
+		lp->lp_holdmax = 0;
+		lp->lp_next = NULL;
+		lp->lp_listed = false;
+	}
+	lockprof_list = NULL;
+	lockprof_unlock(s);
+}
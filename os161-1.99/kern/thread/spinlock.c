@@ -48,8 +48,12 @@
 void
 spinlock_init(struct spinlock *lk)
 {
-	spinlock_data_set(&lk->lk_lock, 0);
+	spinlock_data_set(&lk->lk_next, 0);
+	spinlock_data_set(&lk->lk_serving, 0);
 	lk->lk_holder = NULL;
+#if OPT_LOCKSTATS
+	lockprof_init(&lk->lk_prof, lk, NULL);
+#endif
 }
 
 /*
@@ -59,20 +63,29 @@ void
 spinlock_cleanup(struct spinlock *lk)
 {
 	KASSERT(lk->lk_holder == NULL);
-	KASSERT(spinlock_data_get(&lk->lk_lock) == 0);
+	KASSERT(spinlock_data_get(&lk->lk_next) ==
+		spinlock_data_get(&lk->lk_serving));
+#if OPT_LOCKSTATS
+	lockprof_cleanup(&lk->lk_prof);
+#endif
 }
 
 /*
  * Get the lock.
  *
  * First disable interrupts (otherwise, if we get a timer interrupt we
- * might come back to this lock and deadlock), then use a machine-level
- * atomic operation to wait for the lock to be free.
+ * might come back to this lock and deadlock), then take a ticket with
+ * a machine-level atomic increment and wait for it to be served.
  */
 void
 spinlock_acquire(struct spinlock *lk)
 {
 	struct cpu *mycpu;
+	spinlock_data_t ticket;
+#if OPT_LOCKSTATS
+	uint32_t waitstart = 0;
+	bool contended = false;
+#endif
 
 	splraise(IPL_NONE, IPL_HIGH);
 
@@ -87,27 +100,31 @@ spinlock_acquire(struct spinlock *lk)
 		mycpu = NULL;
 	}
 
-	while (1) {
-		/*
-		 * Do test-test-and-set, that is, read first before
-		 * doing test-and-set, to reduce bus contention.
-		 *
-		 * Test-and-set is a machine-level atomic operation
-		 * that writes 1 into the lock word and returns the
-		 * previous value. If that value was 0, the lock was
-		 * previously unheld and we now own it. If it was 1,
-		 * we don't.
-		 */
-		if (spinlock_data_get(&lk->lk_lock) != 0) {
-			continue;
+	/*
+	 * The only atomic operation is taking the ticket; after that
+	 * we just read lk_serving until it comes round to us. Only
+	 * the holder ever writes lk_serving, so the waiters do not
+	 * fight over the lock word the way test-and-set does, and
+	 * nobody can jump the queue.
+	 *
+	 * The counters wrap, which is harmless as long as there are
+	 * fewer than 2^32 waiters.
+	 */
+	ticket = spinlock_data_fetchinc(&lk->lk_next);
+	while (spinlock_data_get(&lk->lk_serving) != ticket) {
+#if OPT_LOCKSTATS
+		if (!contended) {
+			waitstart = cpu_cycles();
+			contended = true;
 		}
-		if (spinlock_data_testandset(&lk->lk_lock) != 0) {
-			continue;
-		}
-		break;
+#endif
 	}
 
 	lk->lk_holder = mycpu;
+#if OPT_LOCKSTATS
+	lockprof_acquired(&lk->lk_prof, waitstart, contended,
+			  __builtin_return_address(0));
+#endif
 }
 
 /*
@@ -121,8 +138,13 @@ spinlock_release(struct spinlock *lk)
 		KASSERT(lk->lk_holder == curcpu->c_self);
 	}
 
+#if OPT_LOCKSTATS
+	lockprof_released(&lk->lk_prof);
+#endif
 	lk->lk_holder = NULL;
-	spinlock_data_set(&lk->lk_lock, 0);
+	/* pass the lock to the next ticket */
+	spinlock_data_set(&lk->lk_serving,
+			  spinlock_data_get(&lk->lk_serving) + 1);
 	spllower(IPL_HIGH, IPL_NONE);
 }
 
@@ -33,7 +33,10 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
+#include <cpu.h>
+#include <kmem.h>
 #include <spinlock.h>
 #include <wchan.h>
 #include <thread.h>
@@ -44,6 +47,40 @@
 //
 // Semaphore.
 
+/*
+ * Semaphores, locks and CVs come from object caches whose constructors
+ * set up the wchan and spinlock once per slab, so creating and
+ * destroying one is just the name plus a few stores.
+ */
+
+static
+int
+sem_ctor(void *obj)
+{
+	struct semaphore *sem = obj;
+
+	sem->sem_wchan = wchan_create(NULL);
+	if (sem->sem_wchan == NULL) {
+		return ENOMEM;
+	}
+	spinlock_init(&sem->sem_lock);
+	return 0;
+}
+
+static
+void
+sem_dtor(void *obj)
+{
+	struct semaphore *sem = obj;
+
+	spinlock_cleanup(&sem->sem_lock);
+	wchan_destroy(sem->sem_wchan);
+}
+
+static struct kmem_cache sem_cache =
+	KMEM_CACHE_INITIALIZER("semaphore", sizeof(struct semaphore),
+			       sem_ctor, sem_dtor);
+
 struct semaphore *
 sem_create(const char *name, int initial_count)
 {
@@ -51,26 +88,22 @@ sem_create(const char *name, int initial_count)
 
         KASSERT(initial_count >= 0);
 
-        sem = kmalloc(sizeof(struct semaphore));
+        sem = kmem_cache_alloc(&sem_cache);
         if (sem == NULL) {
                 return NULL;
         }
 
         sem->sem_name = kstrdup(name);
         if (sem->sem_name == NULL) {
-                kfree(sem);
+                kmem_cache_free(&sem_cache, sem);
                 return NULL;
         }
 
-	sem->sem_wchan = wchan_create(sem->sem_name);
-	if (sem->sem_wchan == NULL) {
-		kfree(sem->sem_name);
-		kfree(sem);
-		return NULL;
-	}
-
-	spinlock_init(&sem->sem_lock);
+	wchan_setname(sem->sem_wchan, sem->sem_name);
         sem->sem_count = initial_count;
+#if OPT_LOCKSTATS
+	lockprof_init(&sem->sem_prof, sem, sem->sem_name);
+#endif
 
         return sem;
 }
@@ -80,16 +113,24 @@ sem_destroy(struct semaphore *sem)
 {
         KASSERT(sem != NULL);
 
-	/* wchan_cleanup will assert if anyone's waiting on it */
-	spinlock_cleanup(&sem->sem_lock);
-	wchan_destroy(sem->sem_wchan);
+	/* the wchan is kept for the next user; it had better be empty */
+	KASSERT(wchan_isempty(sem->sem_wchan));
+	wchan_setname(sem->sem_wchan, NULL);
+#if OPT_LOCKSTATS
+	lockprof_cleanup(&sem->sem_prof);
+#endif
         kfree(sem->sem_name);
-        kfree(sem);
+        kmem_cache_free(&sem_cache, sem);
 }
 
 void 
 P(struct semaphore *sem)
 {
+#if OPT_LOCKSTATS
+	uint32_t waitstart = cpu_cycles();
+	bool contended;
+#endif
+
         KASSERT(sem != NULL);
 
         /*
@@ -101,6 +142,9 @@ P(struct semaphore *sem)
         KASSERT(curthread->t_in_interrupt == false);
 
 	spinlock_acquire(&sem->sem_lock);
+#if OPT_LOCKSTATS
+	contended = (sem->sem_count == 0);
+#endif
         while (sem->sem_count == 0) {
 		/*
 		 * Bridge to the wchan lock, so if someone else comes
@@ -126,6 +170,10 @@ P(struct semaphore *sem)
         }
         KASSERT(sem->sem_count > 0);
         sem->sem_count--;
+#if OPT_LOCKSTATS
+	lockprof_acquired(&sem->sem_prof, waitstart, contended,
+			  __builtin_return_address(0));
+#endif
 	spinlock_release(&sem->sem_lock);
 }
 
@@ -147,33 +195,57 @@ V(struct semaphore *sem)
 //
 // Lock.
 
+static
+int
+lock_ctor(void *obj)
+{
+	struct lock *lock = obj;
+
+	lock->lk_wchan = wchan_create(NULL);
+	if (lock->lk_wchan == NULL) {
+		return ENOMEM;
+	}
+	spinlock_init(&lock->lk_lock);
+	return 0;
+}
+
+static
+void
+lock_dtor(void *obj)
+{
+	struct lock *lock = obj;
+
+	spinlock_cleanup(&lock->lk_lock);
+	wchan_destroy(lock->lk_wchan);
+}
+
+static struct kmem_cache lock_cache =
+	KMEM_CACHE_INITIALIZER("lock", sizeof(struct lock),
+			       lock_ctor, lock_dtor);
+
 struct lock *
 lock_create(const char *name)
 {
         struct lock *lock;
 
-        lock = kmalloc(sizeof(struct lock));
+        lock = kmem_cache_alloc(&lock_cache);
         if (lock == NULL) {
                 return NULL;
         }
 
         lock->lk_name = kstrdup(name);
         if (lock->lk_name == NULL) {
-                kfree(lock);
+                kmem_cache_free(&lock_cache, lock);
                 return NULL;
         }
         
         // add stuff here as needed
-	lock->lk_wchan = wchan_create(lock->lk_name);
-
-	if (lock->lk_wchan == NULL) {
-		kfree(lock->lk_name);
-		kfree(lock);
-		return NULL;
-	}
-	spinlock_init(&lock->lk_lock);
+	wchan_setname(lock->lk_wchan, lock->lk_name);
 	lock->held = 0;        
 	lock->lk_thread = NULL;
+#if OPT_LOCKSTATS
+	lockprof_init(&lock->lk_prof, lock, lock->lk_name);
+#endif
 	return lock;
 }
 
@@ -183,47 +255,135 @@ lock_destroy(struct lock *lock)
         KASSERT(lock != NULL);
 
         // add stuff here as needed
-	spinlock_cleanup(&lock->lk_lock);
-	wchan_destroy(lock->lk_wchan);        
+	KASSERT(wchan_isempty(lock->lk_wchan));
+	wchan_setname(lock->lk_wchan, NULL);
+#if OPT_LOCKSTATS
+	lockprof_cleanup(&lock->lk_prof);
+#endif
        
         kfree(lock->lk_name);
-        kfree(lock);
+        kmem_cache_free(&lock_cache, lock);
+}
+
+/*
+ * Upper bound on the busy-wait loops a thread spends on one
+ * lock_acquire before it gives up and sleeps, even if the holder is
+ * still running. Critical sections under a sleep lock are normally a
+ * few hundred instructions; anything much longer than this is cheaper
+ * to sleep through.
+ */
+#define LOCK_SPIN_MAX  2000
+
+/*
+ * True if the lock holder is on a processor right now, other than
+ * ours, and so can be expected to release the lock soon.
+ */
+static
+bool
+lock_owner_running(volatile struct thread *owner)
+{
+	return owner != NULL && owner->t_state == S_RUN &&
+		owner->t_cpu != curcpu;
 }
 
 void
 lock_acquire(struct lock *lock)
 {
-        // Write this
+	volatile struct thread *owner;
+	unsigned spins = 0;
+	bool slept = false;
+#if OPT_LOCKSTATS
+	uint32_t waitstart = cpu_cycles();
+#endif
+
+	KASSERT(lock != NULL);
 	KASSERT(curthread->t_in_interrupt == false);
+
 	spinlock_acquire(&lock->lk_lock);
 	while (lock->held && !lock_do_i_hold(lock)) {
+		owner = lock->lk_thread;
+		if (spins < LOCK_SPIN_MAX && lock_owner_running(owner)) {
+			/*
+			 * Wait without the spinlock until the lock is
+			 * released, changes hands, or its holder stops
+			 * running; then look again.
+			 */
+			spinlock_release(&lock->lk_lock);
+			while (spins < LOCK_SPIN_MAX && lock->held &&
+			       lock->lk_thread == owner &&
+			       lock_owner_running(owner)) {
+				spins++;
+			}
+			spins++;
+			spinlock_acquire(&lock->lk_lock);
+			continue;
+		}
 		wchan_lock(lock->lk_wchan);
 		spinlock_release(&lock->lk_lock);
 		wchan_sleep(lock->lk_wchan);
+		slept = true;
 		spinlock_acquire(&lock->lk_lock);
 	}
+	/* either free, or handed to us by lock_release */
 	KASSERT(!lock->held || lock_do_i_hold(lock));
-	
-	lock->lk_thread = (struct thread*)curthread;
+
+	lock->lk_thread = curthread;
 	lock->held = 1;
+#if OPT_LOCKSTATS
+	lockprof_acquired(&lock->lk_prof, waitstart, spins > 0 || slept,
+			  __builtin_return_address(0));
+#endif
+	/* holding lk_lock keeps us on this cpu */
+	if (slept) {
+		curcpu->c_lock_slept++;
+	}
+	else if (spins > 0) {
+		curcpu->c_lock_spun++;
+	}
 	spinlock_release(&lock->lk_lock);
-        //(void)lock;  // suppress warning until code gets written
 }
 
 void
 lock_release(struct lock *lock)
 {
-        // Write this
+	struct thread *next;
+
 	KASSERT(lock != NULL);
-    
-    spinlock_acquire(&lock->lk_lock);
-    lock->held = 0;
-    wchan_wakeone(lock->lk_wchan);
-    
-    spinlock_release(&lock->lk_lock);
-    
-    lock->lk_thread = NULL;
-        //(void)lock;  // suppress warning until code gets written
+
+	spinlock_acquire(&lock->lk_lock);
+#if OPT_LOCKSTATS
+	lockprof_released(&lock->lk_prof);
+#endif
+	/*
+	 * If anyone is asleep on the lock, it stays held and passes
+	 * straight to them; they can't look at it until we drop
+	 * lk_lock, by which time lk_thread names them.
+	 */
+	next = wchan_wakeone(lock->lk_wchan);
+	if (next != NULL) {
+		lock->lk_thread = next;
+		curcpu->c_lock_handoffs++;
+	}
+	else {
+		lock->lk_thread = NULL;
+		lock->held = 0;
+	}
+	spinlock_release(&lock->lk_lock);
+}
+
+void
+lock_getstats(struct lock_stats *ls)
+{
+	struct cpu *c;
+	unsigned i;
+
+	ls->ls_spun = ls->ls_slept = ls->ls_handoffs = 0;
+	for (i=0; i<cpu_count(); i++) {
+		c = cpu_get(i);
+		ls->ls_spun += c->c_lock_spun;
+		ls->ls_slept += c->c_lock_slept;
+		ls->ls_handoffs += c->c_lock_handoffs;
+	}
 }
 
 bool
@@ -241,29 +401,49 @@ lock_do_i_hold(struct lock *lock)
 // CV
 
 
+static
+int
+cv_ctor(void *obj)
+{
+	struct cv *cv = obj;
+
+	cv->cv_wchan = wchan_create(NULL);
+	if (cv->cv_wchan == NULL) {
+		return ENOMEM;
+	}
+	return 0;
+}
+
+static
+void
+cv_dtor(void *obj)
+{
+	struct cv *cv = obj;
+
+	wchan_destroy(cv->cv_wchan);
+}
+
+static struct kmem_cache cv_cache =
+	KMEM_CACHE_INITIALIZER("cv", sizeof(struct cv), cv_ctor, cv_dtor);
+
 struct cv *
 cv_create(const char *name)
 {
         struct cv *cv;
 
-        cv = kmalloc(sizeof(struct cv));
+        cv = kmem_cache_alloc(&cv_cache);
         if (cv == NULL) {
                return NULL;
         }
 
         cv->cv_name = kstrdup(name);
         if (cv->cv_name==NULL) {
-                kfree(cv);
+                kmem_cache_free(&cv_cache, cv);
                 return NULL;
         }
         
         // add stuff here as needed
-        cv->cv_wchan = wchan_create(cv->cv_name);
-        if (cv->cv_wchan == NULL) {
-                kfree(cv->cv_name);
-                kfree(cv);
-                return NULL;
-        }
+        wchan_setname(cv->cv_wchan, cv->cv_name);
 	return cv;
 }
 
@@ -273,10 +453,11 @@ cv_destroy(struct cv *cv)
         KASSERT(cv != NULL);
 
         // add stuff here as needed
-	wchan_destroy(cv->cv_wchan);        
+	KASSERT(wchan_isempty(cv->cv_wchan));
+	wchan_setname(cv->cv_wchan, NULL);
 
         kfree(cv->cv_name);
-        kfree(cv);
+        kmem_cache_free(&cv_cache, cv);
 }
 
 void
@@ -309,3 +490,164 @@ cv_broadcast(struct cv *cv, struct lock *lock)
 	//(void)cv;    // suppress warning until code gets written
 	(void)lock;  // suppress warning until code gets written
 }
+
+////////////////////////////////////////////////////////////
+//
+// Reader-writer lock
+
+
+static
+int
+rwlock_ctor(void *obj)
+{
+	struct rwlock *rw = obj;
+
+	rw->rw_rwchan = wchan_create(NULL);
+	if (rw->rw_rwchan == NULL) {
+		return ENOMEM;
+	}
+	rw->rw_wwchan = wchan_create(NULL);
+	if (rw->rw_wwchan == NULL) {
+		wchan_destroy(rw->rw_rwchan);
+		return ENOMEM;
+	}
+	spinlock_init(&rw->rw_lock);
+	return 0;
+}
+
+static
+void
+rwlock_dtor(void *obj)
+{
+	struct rwlock *rw = obj;
+
+	spinlock_cleanup(&rw->rw_lock);
+	wchan_destroy(rw->rw_wwchan);
+	wchan_destroy(rw->rw_rwchan);
+}
+
+static struct kmem_cache rwlock_cache =
+	KMEM_CACHE_INITIALIZER("rwlock", sizeof(struct rwlock),
+			       rwlock_ctor, rwlock_dtor);
+
+struct rwlock *
+rwlock_create(const char *name)
+{
+	struct rwlock *rw;
+
+	rw = kmem_cache_alloc(&rwlock_cache);
+	if (rw == NULL) {
+		return NULL;
+	}
+
+	rw->rw_name = kstrdup(name);
+	if (rw->rw_name == NULL) {
+		kmem_cache_free(&rwlock_cache, rw);
+		return NULL;
+	}
+
+	wchan_setname(rw->rw_rwchan, rw->rw_name);
+	wchan_setname(rw->rw_wwchan, rw->rw_name);
+	rw->rw_readers = 0;
+	rw->rw_wwaiting = 0;
+	rw->rw_writer = NULL;
+	return rw;
+}
+
+void
+rwlock_destroy(struct rwlock *rw)
+{
+	KASSERT(rw != NULL);
+	KASSERT(rw->rw_readers == 0);
+	KASSERT(rw->rw_writer == NULL);
+	KASSERT(wchan_isempty(rw->rw_rwchan));
+	KASSERT(wchan_isempty(rw->rw_wwchan));
+
+	wchan_setname(rw->rw_rwchan, NULL);
+	wchan_setname(rw->rw_wwchan, NULL);
+	kfree(rw->rw_name);
+	kmem_cache_free(&rwlock_cache, rw);
+}
+
+void
+rwlock_acquire_read(struct rwlock *rw)
+{
+	KASSERT(rw != NULL);
+	KASSERT(curthread->t_in_interrupt == false);
+
+	spinlock_acquire(&rw->rw_lock);
+	KASSERT(rw->rw_writer != curthread);
+	while (rw->rw_writer != NULL || rw->rw_wwaiting > 0) {
+		wchan_lock(rw->rw_rwchan);
+		spinlock_release(&rw->rw_lock);
+		wchan_sleep(rw->rw_rwchan);
+		spinlock_acquire(&rw->rw_lock);
+	}
+	rw->rw_readers++;
+	spinlock_release(&rw->rw_lock);
+}
+
+void
+rwlock_release_read(struct rwlock *rw)
+{
+	KASSERT(rw != NULL);
+
+	spinlock_acquire(&rw->rw_lock);
+	KASSERT(rw->rw_readers > 0);
+	KASSERT(rw->rw_writer == NULL);
+	rw->rw_readers--;
+	if (rw->rw_readers == 0 && rw->rw_wwaiting > 0) {
+		wchan_wakeone(rw->rw_wwchan);
+	}
+	spinlock_release(&rw->rw_lock);
+}
+
+void
+rwlock_acquire_write(struct rwlock *rw)
+{
+	KASSERT(rw != NULL);
+	KASSERT(curthread->t_in_interrupt == false);
+
+	spinlock_acquire(&rw->rw_lock);
+	KASSERT(rw->rw_writer != curthread);
+	rw->rw_wwaiting++;
+	while (rw->rw_writer != NULL || rw->rw_readers > 0) {
+		wchan_lock(rw->rw_wwchan);
+		spinlock_release(&rw->rw_lock);
+		wchan_sleep(rw->rw_wwchan);
+		spinlock_acquire(&rw->rw_lock);
+	}
+	rw->rw_wwaiting--;
+	rw->rw_writer = curthread;
+	spinlock_release(&rw->rw_lock);
+}
+
+void
+rwlock_release_write(struct rwlock *rw)
+{
+	KASSERT(rw != NULL);
+
+	spinlock_acquire(&rw->rw_lock);
+	KASSERT(rw->rw_writer == curthread);
+	KASSERT(rw->rw_readers == 0);
+	rw->rw_writer = NULL;
+	/*
+	 * Pass the lock to the next writer if there is one; the readers
+	 * would only go back to sleep. Otherwise let all readers in.
+	 */
+	if (rw->rw_wwaiting > 0) {
+		wchan_wakeone(rw->rw_wwchan);
+	}
+	else {
+		wchan_wakeall(rw->rw_rwchan);
+	}
+	spinlock_release(&rw->rw_lock);
+}
+
+bool
+rwlock_do_i_hold_write(struct rwlock *rw)
+{
+	KASSERT(rw != NULL);
+
+	return rw->rw_writer == curthread;
+}
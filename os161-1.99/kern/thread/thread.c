@@ -36,6 +36,7 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
+#include <kmem.h>
 #include <array.h>
 #include <cpu.h>
 #include <spl.h>
@@ -48,10 +49,13 @@
 #include <current.h>
 #include <synch.h>
 #include <addrspace.h>
+#include <vm.h>
 #include <mainbus.h>
 #include <vnode.h>
+#include <clock.h>
 
 #include "opt-synchprobs.h"
+#include "opt-kmallocstats.h"
 
 
 /* Magic number used as a guard value on kernel thread stacks. */
@@ -64,6 +68,28 @@ struct wchan {
 	struct spinlock wc_lock;	/* lock for mutual exclusion */
 };
 
+/* Object caches for thread and wchan structures. */
+static struct kmem_cache thread_cache =
+	KMEM_CACHE_INITIALIZER("thread", sizeof(struct thread), NULL, NULL);
+static struct kmem_cache wchan_cache =
+	KMEM_CACHE_INITIALIZER("wchan", sizeof(struct wchan), NULL, NULL);
+
+/*
+ * Multilevel feedback queue.
+ *
+ * Each cpu's run queue is kept sorted by t_prio, FIFO within a level,
+ * so the head is always the best thread to run. A thread starts at
+ * level 0 and drops a level every time it runs through a whole
+ * quantum; quanta double at each level, so CPU-bound threads end up
+ * at the bottom running in long slices while threads that block early
+ * stay on top. Waking up from a wchan moves a thread up a level.
+ * schedule() periodically puts everything back on level 0 so nothing
+ * at the bottom starves.
+ */
+#define MLFQ_NLEVELS		4
+#define MLFQ_BOOST_HARDCLOCKS	HZ	/* everyone to the top once a second */
+static const unsigned mlfq_quanta[MLFQ_NLEVELS] = { 1, 2, 4, 8 };
+
 /* Master array of CPUs. */
 DECLARRAY(cpu);
 DEFARRAY(cpu, /*no inline*/ );
@@ -112,37 +138,55 @@ thread_checkstack(struct thread *thread)
 }
 
 /*
- * Create a thread. This is used both to create a first thread
- * for each CPU and to create subsequent forked threads.
+ * Set a thread's name, in the thread itself if it fits.
  */
 static
-struct thread *
-thread_create(const char *name)
+int
+thread_setname(struct thread *thread, const char *name)
 {
-	struct thread *thread;
-
-	DEBUGASSERT(name != NULL);
-
-	thread = kmalloc(sizeof(*thread));
-	if (thread == NULL) {
-		return NULL;
+	if (strlen(name) < THREAD_NAMELEN) {
+		strcpy(thread->t_namebuf, name);
+		thread->t_name = thread->t_namebuf;
+		return 0;
 	}
-
 	thread->t_name = kstrdup(name);
 	if (thread->t_name == NULL) {
-		kfree(thread);
-		return NULL;
+		return ENOMEM;
+	}
+	return 0;
+}
+
+static
+void
+thread_freename(struct thread *thread)
+{
+	if (thread->t_name != thread->t_namebuf) {
+		kfree(thread->t_name);
 	}
+	thread->t_name = NULL;
+}
+
+/*
+ * Initialize everything in a thread except its name and stack. Used
+ * for new threads and for threads taken back out of the per-cpu
+ * cache.
+ */
+static
+void
+thread_init(struct thread *thread)
+{
 	thread->t_wchan_name = "NEW";
 	thread->t_state = S_READY;
 
 	/* Thread subsystem fields */
 	thread_machdep_init(&thread->t_machdep);
 	threadlistnode_init(&thread->t_listnode, thread);
-	thread->t_stack = NULL;
 	thread->t_context = NULL;
 	thread->t_cpu = NULL;
 	thread->t_proc = NULL;
+	thread->t_prio = 0;
+	thread->t_quantum = mlfq_quanta[0];
+	thread->t_lastrun = 0;
 
 	/* Interrupt state fields */
 	thread->t_in_interrupt = false;
@@ -150,6 +194,31 @@ thread_create(const char *name)
 	thread->t_iplhigh_count = 1; /* corresponding to t_curspl */
 
 	/* If you add to struct thread, be sure to initialize here */
+}
+
+/*
+ * Create a thread. This is used both to create a first thread
+ * for each CPU and to create subsequent forked threads.
+ */
+static
+struct thread *
+thread_create(const char *name)
+{
+	struct thread *thread;
+
+	DEBUGASSERT(name != NULL);
+
+	thread = kmem_cache_alloc(&thread_cache);
+	if (thread == NULL) {
+		return NULL;
+	}
+
+	if (thread_setname(thread, name)) {
+		kmem_cache_free(&thread_cache, thread);
+		return NULL;
+	}
+	thread->t_stack = NULL;
+	thread_init(thread);
 
 	return thread;
 }
@@ -167,6 +236,7 @@ cpu_create(unsigned hardware_number)
 {
 	struct cpu *c;
 	int result;
+	unsigned i;
 	char namebuf[16];
 
 	c = kmalloc(sizeof(*c));
@@ -179,14 +249,38 @@ cpu_create(unsigned hardware_number)
 
 	c->c_curthread = NULL;
 	threadlist_init(&c->c_zombies);
+	threadlist_init(&c->c_threadcache);
+	c->c_threadcache_hits = c->c_threadcache_misses = 0;
 	c->c_hardclocks = 0;
+	c->c_idleclocks = 0;
+	c->c_lock_spun = c->c_lock_slept = c->c_lock_handoffs = 0;
+#if OPT_A3
+	c->c_nframes = 0;
+	c->c_frame_allochits = c->c_frame_allocmisses = 0;
+	c->c_frame_freehits = c->c_frame_freemisses = 0;
+	c->c_asidgen = 0;
+	c->c_tlbpid = 0;
+	c->c_tlbhand = 0;
+	c->c_tlbref = 0;
+#endif /* OPT_A3 */
+	for (i=0; i<CPU_KMALLOC_NSIZES; i++) {
+		c->c_nkmag[i] = 0;
+	}
+	c->c_kmalloc_hits = c->c_kmalloc_misses = 0;
+	c->c_kfree_hits = c->c_kfree_misses = 0;
+#if OPT_KMALLOCSTATS
+	bzero(&c->c_kmstat, sizeof(c->c_kmstat));
+#endif
 
 	c->c_isidle = false;
 	threadlist_init(&c->c_runqueue);
 	spinlock_init(&c->c_runqueue_lock);
+	c->c_steals = c->c_stolen = 0;
 
 	c->c_ipi_pending = 0;
 	c->c_numshootdown = 0;
+	c->c_shootdown_seq = 0;
+	c->c_shootdown_ipis = 0;
 	spinlock_init(&c->c_ipi_lock);
 
 	result = cpuarray_add(&allcpus, c, &c->c_number);
@@ -227,6 +321,22 @@ cpu_create(unsigned hardware_number)
 	return c;
 }
 
+/*
+ * Accessors for the cpu array. CPUs are only ever added, and only
+ * during boot, so no locking is needed.
+ */
+unsigned
+cpu_count(void)
+{
+	return cpuarray_num(&allcpus);
+}
+
+struct cpu *
+cpu_get(unsigned n)
+{
+	return cpuarray_get(&allcpus, n);
+}
+
 /*
  * Destroy a thread.
  *
@@ -258,8 +368,64 @@ thread_destroy(struct thread *thread)
 	/* sheer paranoia */
 	thread->t_wchan_name = "DESTROYED";
 
-	kfree(thread->t_name);
-	kfree(thread);
+	thread_freename(thread);
+	kmem_cache_free(&thread_cache, thread);
+}
+
+/*
+ * Put a reaped thread, stack and all, on this cpu's thread cache
+ * instead of freeing it. Called from exorcise(), at splhigh.
+ */
+static
+void
+thread_recycle(struct thread *thread)
+{
+	KASSERT(thread->t_proc == NULL);
+	KASSERT(thread->t_stack != NULL);
+	KASSERT(curthread->t_curspl > 0);
+
+	thread_machdep_cleanup(&thread->t_machdep);
+	thread_freename(thread);
+	thread->t_wchan_name = "RECYCLED";
+
+	/* LIFO, so the stack we hand out next is the most recently used */
+	threadlist_addhead(&curcpu->c_threadcache, thread);
+}
+
+/*
+ * Take a thread out of this cpu's thread cache and set it up as a
+ * new thread named NAME. Returns NULL if the cache is empty. The
+ * thread still has its old stack.
+ */
+static
+struct thread *
+thread_reuse(const char *name)
+{
+	struct thread *thread;
+	struct cpu *c;
+	int spl;
+
+	spl = splhigh();
+	c = curcpu->c_self;
+	thread = threadlist_remhead(&c->c_threadcache);
+	if (thread != NULL) {
+		c->c_threadcache_hits++;
+	}
+	else {
+		c->c_threadcache_misses++;
+	}
+	splx(spl);
+
+	if (thread == NULL) {
+		return NULL;
+	}
+
+	if (thread_setname(thread, name)) {
+		thread_destroy(thread);
+		return NULL;
+	}
+	thread_init(thread);
+	return thread;
 }
 
 /*
@@ -277,7 +443,13 @@ exorcise(void)
 	while ((z = threadlist_remhead(&curcpu->c_zombies)) != NULL) {
 		KASSERT(z != curthread);
 		KASSERT(z->t_state == S_ZOMBIE);
-		thread_destroy(z);
+		if (z->t_stack != NULL &&
+		    curcpu->c_threadcache.tl_count < CPU_THREAD_CACHE) {
+			thread_recycle(z);
+		}
+		else {
+			thread_destroy(z);
+		}
 	}
 }
 
@@ -426,6 +598,42 @@ thread_start_cpus(void)
 	cpu_startup_sem = NULL;
 }
 
+/*
+ * Put T on C's run queue behind every thread of the same or better
+ * priority. Scans from the tail, since T usually goes there.
+ */
+static
+void
+thread_runqueue_insert(struct cpu *c, struct thread *t)
+{
+	struct threadlistnode *tln;
+
+	KASSERT(spinlock_do_i_hold(&c->c_runqueue_lock));
+
+	for (tln = c->c_runqueue.tl_tail.tln_prev; tln->tln_prev != NULL;
+	     tln = tln->tln_prev) {
+		if (tln->tln_self->t_prio <= t->t_prio) {
+			threadlist_insertafter(&c->c_runqueue,
+					       tln->tln_self, t);
+			return;
+		}
+	}
+	threadlist_addhead(&c->c_runqueue, t);
+}
+
+static struct thread *thread_steal(struct cpu *thief, bool idle);
+
+/*
+ * Return the thread at the head of C's run queue, or NULL.
+ */
+static
+struct thread *
+thread_runqueue_peek(struct cpu *c)
+{
+	KASSERT(spinlock_do_i_hold(&c->c_runqueue_lock));
+	return c->c_runqueue.tl_head.tln_next->tln_self;
+}
+
 /*
  * Make a thread runnable.
  *
@@ -450,7 +658,7 @@ thread_make_runnable(struct thread *target, bool already_have_lock)
 	}
 
 	isidle = targetcpu->c_isidle;
-	threadlist_addtail(&targetcpu->c_runqueue, target);
+	thread_runqueue_insert(targetcpu, target);
 	if (isidle) {
 		/*
 		 * Other processor is idle; send interrupt to make
@@ -487,16 +695,20 @@ thread_fork(const char *name,
 	DEBUG(DB_THREADS,"Forking thread: %s\n",name);
 #endif // UW
 
-	newthread = thread_create(name);
+	/* Reuse a reaped thread and its stack if we have one handy */
+	newthread = thread_reuse(name);
 	if (newthread == NULL) {
-		return ENOMEM;
-	}
+		newthread = thread_create(name);
+		if (newthread == NULL) {
+			return ENOMEM;
+		}
 
-	/* Allocate a stack */
-	newthread->t_stack = kmalloc(STACK_SIZE);
-	if (newthread->t_stack == NULL) {
-		thread_destroy(newthread);
-		return ENOMEM;
+		/* Allocate a stack */
+		newthread->t_stack = kmalloc(STACK_SIZE);
+		if (newthread->t_stack == NULL) {
+			thread_destroy(newthread);
+			return ENOMEM;
+		}
 	}
 	thread_checkstack_init(newthread);
 
@@ -573,11 +785,18 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 	/* Lock the run queue. */
 	spinlock_acquire(&curcpu->c_runqueue_lock);
 
-	/* Micro-optimization: if nothing to do, just return */
-	if (newstate == S_READY && threadlist_isempty(&curcpu->c_runqueue)) {
-		spinlock_release(&curcpu->c_runqueue_lock);
-		splx(spl);
-		return;
+	/*
+	 * Micro-optimization: if nothing to do, just return. Nor is
+	 * there anything to do if everything waiting has lower
+	 * priority than we do; we would just be picked again.
+	 */
+	if (newstate == S_READY) {
+		next = thread_runqueue_peek(curcpu);
+		if (next == NULL || next->t_prio > cur->t_prio) {
+			spinlock_release(&curcpu->c_runqueue_lock);
+			splx(spl);
+			return;
+		}
 	}
 
 	/* Put the thread in the right place. */
@@ -611,9 +830,11 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 		break;
 	}
 	cur->t_state = newstate;
+	cur->t_lastrun = curcpu->c_hardclocks;
 
 	/*
-	 * Get the next thread. While there isn't one, call md_idle().
+	 * Get the next thread. While there isn't one, try to steal one
+	 * from a busier cpu, and failing that call md_idle().
 	 * curcpu->c_isidle must be true when md_idle is
 	 * called. Unlock the runqueue while idling too, to make sure
 	 * things can be added to it.
@@ -635,6 +856,18 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 		next = threadlist_remhead(&curcpu->c_runqueue);
 		if (next == NULL) {
 			spinlock_release(&curcpu->c_runqueue_lock);
+			next = thread_steal(curcpu->c_self, true);
+			spinlock_acquire(&curcpu->c_runqueue_lock);
+			if (next != NULL) {
+				thread_runqueue_insert(curcpu->c_self, next);
+				curcpu->c_steals++;
+				next = NULL;
+				continue;
+			}
+			spinlock_release(&curcpu->c_runqueue_lock);
+#if OPT_A3
+			vm_zero_idle();
+#endif
 			cpu_idle();
 			spinlock_acquire(&curcpu->c_runqueue_lock);
 		}
@@ -819,142 +1052,212 @@ thread_yield(void)
 
 ////////////////////////////////////////////////////////////
 
+/*
+ * Per-tick accounting for the current thread; see the multilevel
+ * feedback queue notes at the top of the file.
+ */
+void
+thread_timeslice(void)
+{
+	struct thread *cur, *next;
+	bool preempt;
+
+	/* Ticks taken while idle belong to nobody. */
+	if (curcpu->c_isidle) {
+		return;
+	}
+
+	cur = curthread;
+	if (cur->t_quantum > 0) {
+		cur->t_quantum--;
+	}
+
+	if (cur->t_quantum == 0) {
+		/* Used the whole slice: CPU-bound, move down. */
+		if (cur->t_prio < MLFQ_NLEVELS - 1) {
+			cur->t_prio++;
+		}
+		cur->t_quantum = mlfq_quanta[cur->t_prio];
+		thread_yield();
+		return;
+	}
+
+	/* Time left, but give way if something better woke up. */
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+	next = thread_runqueue_peek(curcpu);
+	preempt = next != NULL && next->t_prio < cur->t_prio;
+	spinlock_release(&curcpu->c_runqueue_lock);
+	if (preempt) {
+		thread_yield();
+	}
+}
+
+/*
+ * Move a thread that is waking up from a wchan up a level, with a
+ * fresh quantum. Threads that block before using up their slice are
+ * interactive or I/O-bound and should get the cpu back quickly.
+ */
+static
+void
+thread_sleepboost(struct thread *t)
+{
+	if (t->t_prio > 0) {
+		t->t_prio--;
+	}
+	t->t_quantum = mlfq_quanta[t->t_prio];
+}
+
 /*
  * Scheduler.
  *
- * This is called periodically from hardclock(). It should reshuffle
- * the current CPU's run queue by job priority.
+ * This is called periodically from hardclock(). Once every
+ * MLFQ_BOOST_HARDCLOCKS it moves every thread on this cpu back to
+ * the top level, so that CPU-bound threads demoted to the bottom
+ * can't be starved by a steady stream of higher-priority work. The
+ * run queue stays sorted, since everything on it is now level 0 and
+ * their relative order is unchanged.
  */
-
 void
 schedule(void)
 {
-	/*
-	 * You can write this. If we do nothing, threads will run in
-	 * round-robin fashion.
-	 */
+	struct threadlistnode *tln;
+	struct thread *t;
+
+	if (curcpu->c_hardclocks % MLFQ_BOOST_HARDCLOCKS != 0) {
+		return;
+	}
+
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+	for (tln = curcpu->c_runqueue.tl_head.tln_next;
+	     tln->tln_next != NULL; tln = tln->tln_next) {
+		t = tln->tln_self;
+		t->t_prio = 0;
+		t->t_quantum = mlfq_quanta[0];
+	}
+	if (!curcpu->c_isidle) {
+		curthread->t_prio = 0;
+		curthread->t_quantum = mlfq_quanta[0];
+	}
+	spinlock_release(&curcpu->c_runqueue_lock);
 }
 
 /*
  * Thread migration.
  *
- * This is also called periodically from hardclock(). If the current
- * CPU is busy and other CPUs are idle, or less busy, it should move
- * threads across to those other other CPUs.
+ * Migration is pull-based: a cpu that runs out of work steals a
+ * ready thread from the busiest other cpu before it goes idle (see
+ * thread_switch), and every MIGRATE_HARDCLOCKS a busy cpu checks
+ * whether some other cpu has at least two more threads queued than
+ * it does and pulls one over if so (thread_consider_migration).
  *
  * Migrating threads isn't free because of cache affinity; a thread's
  * working cache set will end up having to be moved to the other CPU,
- * which is fairly slow. The tradeoff between this performance loss
- * and the performance loss due to underutilization of some CPUs is
- * something that needs to be tuned and probably is workload-specific.
- *
- * For here and now, because we know we're running on System/161 and
- * System/161 does not (yet) model such cache effects, we'll be very
- * aggressive.
+ * which is fairly slow. So the victim is chosen from the tail of the
+ * run queue (lowest priority, queued most recently) and threads that
+ * ran on their cpu within the last STEAL_HOT_HARDCLOCKS are passed
+ * over while there is anything colder. An idle cpu will take a hot
+ * thread if there is nothing else, since running it somewhere beats
+ * leaving a cpu idle; a busy cpu only rebalances with cold threads.
  */
-void
-thread_consider_migration(void)
+
+#define STEAL_HOT_HARDCLOCKS	2
+
+static
+struct thread *
+thread_steal(struct cpu *thief, bool idle)
 {
-	unsigned my_count, total_count, one_share, to_send;
-	unsigned i, numcpus;
-	struct cpu *c;
-	struct threadlist victims;
-	struct thread *t;
+	struct cpu *c, *victim;
+	struct threadlistnode *tln;
+	struct thread *t, *pick;
+	unsigned i, numcpus, mine, most;
 
-	my_count = total_count = 0;
+	/*
+	 * Find the busiest other cpu. The counts are read without the
+	 * locks; they're only a hint and are checked again below.
+	 */
+	mine = thief->c_runqueue.tl_count;
+	victim = NULL;
+	most = 0;
 	numcpus = cpuarray_num(&allcpus);
 	for (i=0; i<numcpus; i++) {
 		c = cpuarray_get(&allcpus, i);
-		spinlock_acquire(&c->c_runqueue_lock);
-		total_count += c->c_runqueue.tl_count;
-		if (c == curcpu->c_self) {
-			my_count = c->c_runqueue.tl_count;
+		if (c == thief) {
+			continue;
+		}
+		if (c->c_runqueue.tl_count > most) {
+			most = c->c_runqueue.tl_count;
+			victim = c;
 		}
-		spinlock_release(&c->c_runqueue_lock);
 	}
-
-	one_share = DIVROUNDUP(total_count, numcpus);
-	if (my_count < one_share) {
-		return;
+	if (victim == NULL || (!idle && most < mine + 2)) {
+		return NULL;
 	}
 
-	to_send = my_count - one_share;
-	threadlist_init(&victims);
-	spinlock_acquire(&curcpu->c_runqueue_lock);
-	for (i=0; i<to_send; i++) {
-		t = threadlist_remtail(&curcpu->c_runqueue);
-		threadlist_addhead(&victims, t);
+	spinlock_acquire(&victim->c_runqueue_lock);
+	if (!idle && victim->c_runqueue.tl_count < mine + 2) {
+		spinlock_release(&victim->c_runqueue_lock);
+		return NULL;
 	}
-	spinlock_release(&curcpu->c_runqueue_lock);
 
-	for (i=0; i < numcpus && to_send > 0; i++) {
-		c = cpuarray_get(&allcpus, i);
-		if (c == curcpu->c_self) {
+	pick = NULL;
+	for (tln = victim->c_runqueue.tl_tail.tln_prev; tln->tln_prev != NULL;
+	     tln = tln->tln_prev) {
+		t = tln->tln_self;
+		/*
+		 * Ordinarily, the victim's curthread will not appear
+		 * on its run queue. However, it can under the
+		 * following circumstances:
+		 *   - it went to sleep;
+		 *   - the processor became idle, so it remained
+		 *     curthread;
+		 *   - it was reawakened, so it was put on the run
+		 *     queue;
+		 *   - and the processor hasn't fully unidled yet, so
+		 *     all these things are still true.
+		 *
+		 * Migrating it in that state would have two cpus
+		 * running on one stack, so never take it.
+		 */
+		if (t == victim->c_curthread) {
 			continue;
 		}
-		spinlock_acquire(&c->c_runqueue_lock);
-		while (c->c_runqueue.tl_count < one_share && to_send > 0) {
-			t = threadlist_remhead(&victims);
-			/*
-			 * Ordinarily, curthread will not appear on
-			 * the run queue. However, it can under the
-			 * following circumstances:
-			 *   - it went to sleep;
-			 *   - the processor became idle, so it
-			 *     remained curthread;
-			 *   - it was reawakened, so it was put on the
-			 *     run queue;
-			 *   - and the processor hasn't fully unidled
-			 *     yet, so all these things are still true.
-			 *
-			 * If the timer interrupt happens at (almost)
-			 * exactly the proper moment, we can come here
-			 * while things are in this state and see
-			 * curthread. However, *migrating* curthread
-			 * can cause bad things to happen (Exercise:
-			 * Why? And what?) so shuffle it to the end of
-			 * the list and decrement to_send in order to
-			 * skip it. Then it goes back on our own run
-			 * queue below.
-			 */
-			if (t == curthread) {
-				threadlist_addtail(&victims, t);
-				to_send--;
-				continue;
-			}
-
-			t->t_cpu = c;
-			threadlist_addtail(&c->c_runqueue, t);
-			DEBUG(DB_THREADS,
-			      "Migrated thread %s: cpu %u -> %u",
-			      t->t_name, curcpu->c_number, c->c_number);
-			to_send--;
-			if (c->c_isidle) {
-				/*
-				 * Other processor is idle; send
-				 * interrupt to make sure it unidles.
-				 */
-				ipi_send(c, IPI_UNIDLE);
-			}
+		if (victim->c_hardclocks - t->t_lastrun >=
+		    STEAL_HOT_HARDCLOCKS) {
+			pick = t;
+			break;
+		}
+		if (idle && pick == NULL) {
+			/* hot, but better than nothing */
+			pick = t;
 		}
-		spinlock_release(&c->c_runqueue_lock);
 	}
 
-	/*
-	 * Because the code above isn't atomic, the thread counts may have
-	 * changed while we were working and we may end up with leftovers.
-	 * Don't panic; just put them back on our own run queue.
-	 */
-	if (!threadlist_isempty(&victims)) {
-		spinlock_acquire(&curcpu->c_runqueue_lock);
-		while ((t = threadlist_remhead(&victims)) != NULL) {
-			threadlist_addtail(&curcpu->c_runqueue, t);
-		}
-		spinlock_release(&curcpu->c_runqueue_lock);
+	if (pick != NULL) {
+		threadlist_remove(&victim->c_runqueue, pick);
+		pick->t_cpu = thief;
+		victim->c_stolen++;
+		DEBUG(DB_THREADS, "Migrated thread %s: cpu %u -> %u",
+		      pick->t_name, victim->c_number, thief->c_number);
 	}
+	spinlock_release(&victim->c_runqueue_lock);
 
-	KASSERT(threadlist_isempty(&victims));
-	threadlist_cleanup(&victims);
+	return pick;
+}
+
+void
+thread_consider_migration(void)
+{
+	struct thread *t;
+
+	t = thread_steal(curcpu->c_self, false);
+	if (t == NULL) {
+		return;
+	}
+
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+	thread_runqueue_insert(curcpu->c_self, t);
+	curcpu->c_steals++;
+	spinlock_release(&curcpu->c_runqueue_lock);
 }
 
 ////////////////////////////////////////////////////////////
@@ -976,7 +1279,7 @@ wchan_create(const char *name)
 {
 	struct wchan *wc;
 
-	wc = kmalloc(sizeof(*wc));
+	wc = kmem_cache_alloc(&wchan_cache);
 	if (wc == NULL) {
 		return NULL;
 	}
@@ -986,6 +1289,18 @@ wchan_create(const char *name)
 	return wc;
 }
 
+/*
+ * Rename a wait channel. Used by objects whose wchan outlives one
+ * incarnation of the object (see the object caches in synch.c).
+ */
+void
+wchan_setname(struct wchan *wc, const char *name)
+{
+	spinlock_acquire(&wc->wc_lock);
+	wc->wc_name = name;
+	spinlock_release(&wc->wc_lock);
+}
+
 /*
  * Destroy a wait channel. Must be empty and unlocked.
  * (The corresponding cleanup functions require this.)
@@ -995,7 +1310,7 @@ wchan_destroy(struct wchan *wc)
 {
 	spinlock_cleanup(&wc->wc_lock);
 	threadlist_cleanup(&wc->wc_threads);
-	kfree(wc);
+	kmem_cache_free(&wchan_cache, wc);
 }
 
 /*
@@ -1031,7 +1346,7 @@ wchan_sleep(struct wchan *wc)
 /*
  * Wake up one thread sleeping on a wait channel.
  */
-void
+struct thread *
 wchan_wakeone(struct wchan *wc)
 {
 	struct thread *target;
@@ -1047,10 +1362,12 @@ wchan_wakeone(struct wchan *wc)
 
 	if (target == NULL) {
 		/* Nobody was sleeping. */
-		return;
+		return NULL;
 	}
 
+	thread_sleepboost(target);
 	thread_make_runnable(target, false);
+	return target;
 }
 
 /*
@@ -1084,6 +1401,7 @@ wchan_wakeall(struct wchan *wc)
 	 * make each thread runnable.
 	 */
 	while ((target = threadlist_remhead(&list)) != NULL) {
+		thread_sleepboost(target);
 		thread_make_runnable(target, false);
 	}
 
@@ -1140,15 +1458,19 @@ ipi_broadcast(int code)
 	}
 }
 
-void
+unsigned
 ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping)
 {
+	unsigned ticket;
 	int n;
 
 	spinlock_acquire(&target->c_ipi_lock);
 
 	n = target->c_numshootdown;
-	if (n == TLBSHOOTDOWN_MAX) {
+	if (n == TLBSHOOTDOWN_ALL) {
+		/* already flushing everything */
+	}
+	else if (n == TLBSHOOTDOWN_MAX) {
 		target->c_numshootdown = TLBSHOOTDOWN_ALL;
 	}
 	else {
@@ -1156,10 +1478,30 @@ ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping)
 		target->c_numshootdown = n+1;
 	}
 
-	target->c_ipi_pending |= (uint32_t)1 << IPI_TLBSHOOTDOWN;
-	mainbus_send_ipi(target);
+	/* one interrupt handles everything queued before it is taken */
+	if ((target->c_ipi_pending & ((uint32_t)1 << IPI_TLBSHOOTDOWN)) == 0) {
+		target->c_ipi_pending |= (uint32_t)1 << IPI_TLBSHOOTDOWN;
+		target->c_shootdown_ipis++;
+		mainbus_send_ipi(target);
+	}
+	ticket = target->c_shootdown_seq;
 
 	spinlock_release(&target->c_ipi_lock);
+	return ticket;
+}
+
+/*
+ * Wait until TARGET has handled the shootdown batch that TICKET was
+ * queued in. The batch is done when the target's sequence number
+ * moves on, which it does while holding c_ipi_lock, so no lock is
+ * needed to watch it.
+ */
+void
+ipi_tlbshootdown_wait(struct cpu *target, unsigned ticket)
+{
+	while (*(volatile unsigned *)&target->c_shootdown_seq == ticket) {
+		/* spin */
+	}
 }
 
 void
@@ -1202,6 +1544,7 @@ interprocessor_interrupt(void)
 			}
 		}
 		curcpu->c_numshootdown = 0;
+		curcpu->c_shootdown_seq++;
 	}
 
 	curcpu->c_ipi_pending = 0;
@@ -246,10 +246,11 @@ null_fsync(struct vnode *v)
  */
 static
 int
-dev_mmap(struct vnode *v  /* add stuff as needed */)
+dev_mmap(struct vnode *v, off_t *size)
 {
 	(void)v;
-	return EUNIMP;
+	(void)size;
+	return ENODEV;
 }
 
 /*
@@ -30,7 +30,13 @@
 #include <types.h>
 #include <lib.h>
 #include <spinlock.h>
+#include <spl.h>
+#include <cpu.h>
+#include <current.h>
 #include <vm.h>
+#include <kmem.h>
+
+#include "opt-kmallocstats.h"
 
 /*
  * Kernel malloc.
@@ -104,6 +110,7 @@ struct freelist {
 struct pageref {
 	struct pageref *next_samesize;
 	struct pageref *next_all;
+	struct pageref *next_hash;
 	vaddr_t pageaddr_and_blocktype;
 	uint16_t freelist_offset;
 	uint16_t nfree;
@@ -118,45 +125,53 @@ struct pageref {
 ////////////////////////////////////////
 
 /*
- * This is cheesy. 
- *
- * The problem is not that it's wasteful - we can only allocate whole
- * pages of pageref structures at a time anyway. The problem is that
- * we really ought to be able to have more than one of these pages.
- *
- * However, for the time being, one page worth of pagerefs gives us
- * 256 pagerefs; this lets us manage 256 * 4k = 1M of kernel heap.
- * That would be twice as much memory as we get for *everything*.
- * Thus, we will cheat and not allow any mechanism for having a second
- * page of pageref structs.
- *
- * Then, since the size is fixed at one page, we'll simplify a bit
- * further by allocating the page in the kernel BSS instead of calling
- * alloc_kpages to get it.
+ * Pagerefs come in page-sized chunks, each with its own inuse bitmap.
+ * The first chunk lives in the BSS so the allocator works before the
+ * VM system is up; when every pageref is taken another chunk is
+ * fetched with alloc_kpages (see subpage_getblocks). Chunks are never
+ * given back - they are small and a heap that grew once is likely to
+ * grow again.
  */
 
-#define NPAGEREFS (PAGE_SIZE / sizeof(struct pageref))
-static struct pageref pagerefs[NPAGEREFS];
+#define PAGEREFPAGE_HDR 64
+#define NPAGEREFS ((PAGE_SIZE - PAGEREFPAGE_HDR) / sizeof(struct pageref))
+#define INUSE_WORDS DIVROUNDUP(NPAGEREFS, 32)
+
+struct pagerefpage {
+	struct pagerefpage *next;
+	unsigned nused;
+	uint32_t inuse[INUSE_WORDS];
+	struct pageref refs[NPAGEREFS];
+};
 
-#define INUSE_WORDS (NPAGEREFS/32)
-static uint32_t pagerefs_inuse[INUSE_WORDS];
+static struct pagerefpage pagerefs_boot;
+static struct pagerefpage *pagerefpages = &pagerefs_boot;
+static unsigned npagerefpages = 1;
 
 static
 struct pageref *
 allocpageref(void)
 {
+	struct pagerefpage *prp;
 	unsigned i,j;
 	uint32_t k;
 
-	for (i=0; i<INUSE_WORDS; i++) {
-		if (pagerefs_inuse[i]==0xffffffff) {
-			/* full */
+	for (prp = pagerefpages; prp != NULL; prp = prp->next) {
+		if (prp->nused == NPAGEREFS) {
 			continue;
 		}
-		for (k=1,j=0; k!=0; k<<=1,j++) {
-			if ((pagerefs_inuse[i] & k)==0) {
-				pagerefs_inuse[i] |= k;
-				return &pagerefs[i*32 + j];
+		for (i=0; i<INUSE_WORDS; i++) {
+			if (prp->inuse[i]==0xffffffff) {
+				/* full */
+				continue;
+			}
+			for (k=1,j=0; k!=0 && i*32+j < NPAGEREFS;
+			     k<<=1,j++) {
+				if ((prp->inuse[i] & k)==0) {
+					prp->inuse[i] |= k;
+					prp->nused++;
+					return &prp->refs[i*32 + j];
+				}
 			}
 		}
 		KASSERT(0);
@@ -170,15 +185,45 @@ static
 void
 freepageref(struct pageref *p)
 {
+	struct pagerefpage *prp;
 	size_t i, j;
 	uint32_t k;
 
-	j = p-pagerefs;
-	KASSERT(j < NPAGEREFS);  /* note: j is unsigned, don't test < 0 */
+	for (prp = pagerefpages; prp != NULL; prp = prp->next) {
+		if (p >= prp->refs && p < prp->refs + NPAGEREFS) {
+			break;
+		}
+	}
+	KASSERT(prp != NULL);
+
+	j = p-prp->refs;
 	i = j/32;
 	k = ((uint32_t)1) << (j%32);
-	KASSERT((pagerefs_inuse[i] & k) != 0);
-	pagerefs_inuse[i] &= ~k;
+	KASSERT((prp->inuse[i] & k) != 0);
+	prp->inuse[i] &= ~k;
+	prp->nused--;
+}
+
+/*
+ * Add a chunk of pagerefs, from a page the caller got from
+ * alloc_kpages. Caller holds kmalloc_spinlock.
+ */
+static
+void
+addpagerefpage(vaddr_t page)
+{
+	struct pagerefpage *prp = (struct pagerefpage *)page;
+	unsigned i;
+
+	KASSERT(sizeof(struct pagerefpage) <= PAGE_SIZE);
+
+	for (i=0; i<INUSE_WORDS; i++) {
+		prp->inuse[i] = 0;
+	}
+	prp->nused = 0;
+	prp->next = pagerefpages;
+	pagerefpages = prp;
+	npagerefpages++;
 }
 
 ////////////////////////////////////////
@@ -186,17 +231,40 @@ freepageref(struct pageref *p)
 static struct pageref *sizebases[NSIZES];
 static struct pageref *allbase;
 
+/*
+ * Hash of page address to pageref, so kfree can find the page a block
+ * belongs to without walking allbase.
+ *
+ * Each bucket has its own spinlock, so a lookup does not need
+ * kmalloc_spinlock. Changing a chain takes both, kmalloc_spinlock
+ * first. A pageref found this way stays valid for as long as its page
+ * has a block that is allocated. That covers kfree, which holds such
+ * a block until it is back on the page. All-zero is a valid unlocked
+ * spinlock, so the buckets need no initialization.
+ */
+#define PAGEHASH_SIZE 128
+#define PAGEHASH(va) (((va) / PAGE_SIZE) % PAGEHASH_SIZE)
+struct pagehash_bucket {
+	struct spinlock ph_lock;
+	struct pageref *ph_head;
+};
+static struct pagehash_bucket pagehash[PAGEHASH_SIZE];
+
 ////////////////////////////////////////
 
 /*
- * Use one spinlock for the whole thing. Making parts of the kmalloc
- * logic per-cpu is worthwhile for scalability; however, for the time
- * being at least we won't, because it adds a lot of complexity and in
- * OS/161 performance and scalability aren't super-critical.
+ * One spinlock protects the pages and pagerefs, apart from the page
+ * hash chains, which have their own locks. Most kmalloc and kfree
+ * calls never take it: they are served from per-cpu magazines (see
+ * below), which go to the pages in batches, and kfree finds a block's
+ * size class through the hash alone.
  */
 
 static struct spinlock kmalloc_spinlock = SPINLOCK_INITIALIZER;
 
+static void kmag_printstats(void);
+static void kmem_printstats(void);
+
 ////////////////////////////////////////
 
 /* SLOWER implies SLOW */
@@ -260,14 +328,14 @@ checksubpages(void)
 	for (i=0; i<NSIZES; i++) {
 		for (pr = sizebases[i]; pr != NULL; pr = pr->next_samesize) {
 			checksubpage(pr);
-			KASSERT(sc < NPAGEREFS);
+			KASSERT(sc < npagerefpages * NPAGEREFS);
 			sc++;
 		}
 	}
 
 	for (pr = allbase; pr != NULL; pr = pr->next_all) {
 		checksubpage(pr);
-		KASSERT(ac < NPAGEREFS);
+		KASSERT(ac < npagerefpages * NPAGEREFS);
 		ac++;
 	}
 
@@ -338,12 +406,16 @@ kheap_printstats(void)
 	/* print the whole thing with interrupts off */
 	spinlock_acquire(&kmalloc_spinlock);
 
-	kprintf("Subpage allocator status:\n");
+	kprintf("Subpage allocator status (%u pageref page%s):\n",
+		npagerefpages, npagerefpages == 1 ? "" : "s");
 
 	for (pr = allbase; pr != NULL; pr = pr->next_all) {
 		dumpsubpage(pr);
 	}
 
+	kmag_printstats();
+	kmem_printstats();
+
 	spinlock_release(&kmalloc_spinlock);
 }
 
@@ -354,6 +426,7 @@ void
 remove_lists(struct pageref *pr, int blktype)
 {
 	struct pageref **guy;
+	struct pagehash_bucket *ph;
 
 	KASSERT(blktype>=0 && blktype<NSIZES);
 
@@ -372,6 +445,16 @@ remove_lists(struct pageref *pr, int blktype)
 			break;
 		}
 	}
+
+	ph = &pagehash[PAGEHASH(PR_PAGEADDR(pr))];
+	spinlock_acquire(&ph->ph_lock);
+	for (guy = &ph->ph_head; *guy; guy = &(*guy)->next_hash) {
+		if (*guy == pr) {
+			*guy = pr->next_hash;
+			break;
+		}
+	}
+	spinlock_release(&ph->ph_lock);
 }
 
 static
@@ -392,64 +475,86 @@ int blocktype(size_t sz)
 	return 0;
 }
 
+/*
+ * Take one block off the freelist of PR. Caller holds kmalloc_spinlock
+ * and has checked that PR has a free block.
+ */
 static
 void *
-subpage_kmalloc(size_t sz)
+subpage_take(struct pageref *pr)
+{
+	vaddr_t prpage;		// PR_PAGEADDR(pr)
+	vaddr_t fla;		// free list entry address
+	struct freelist *fl;	// free list entry
+	void *retptr;		// our result
+
+	KASSERT(pr->nfree > 0);
+	KASSERT(pr->freelist_offset < PAGE_SIZE);
+	prpage = PR_PAGEADDR(pr);
+	fla = prpage + pr->freelist_offset;
+	fl = (struct freelist *)fla;
+
+	retptr = fl;
+	fl = fl->next;
+	pr->nfree--;
+
+	if (fl != NULL) {
+		KASSERT(pr->nfree > 0);
+		fla = (vaddr_t)fl;
+		KASSERT(fla - prpage < PAGE_SIZE);
+		pr->freelist_offset = fla - prpage;
+	}
+	else {
+		KASSERT(pr->nfree == 0);
+		pr->freelist_offset = INVALID_OFFSET;
+	}
+
+	return retptr;
+}
+
+/*
+ * Get up to N blocks of type BLKTYPE from the global pages into
+ * BLOCKS, under one acquisition of kmalloc_spinlock when possible.
+ * Returns how many were obtained; 0 means out of memory.
+ */
+static
+unsigned
+subpage_getblocks(unsigned blktype, void **blocks, unsigned n)
 {
-	unsigned blktype;	// index into sizes[] that we're using
 	struct pageref *pr;	// pageref for page we're allocating from
 	vaddr_t prpage;		// PR_PAGEADDR(pr)
+	vaddr_t prrpage;	// new page of pagerefs, if needed
 	vaddr_t fla;		// free list entry address
 	struct freelist *volatile fl;	// free list entry
-	void *retptr;		// our result
+	struct pagehash_bucket *ph;	// hash bucket for the new page
+	unsigned got = 0;
 
 	volatile int i;
 
-
-	blktype = blocktype(sz);
-	sz = sizes[blktype];
+	KASSERT(n > 0);
 
 	spinlock_acquire(&kmalloc_spinlock);
 
 	checksubpages();
 
-	for (pr = sizebases[blktype]; pr != NULL; pr = pr->next_samesize) {
+	for (pr = sizebases[blktype]; pr != NULL && got < n;
+	     pr = pr->next_samesize) {
 
 		/* check for corruption */
 		KASSERT(PR_BLOCKTYPE(pr) == blktype);
 		checksubpage(pr);
 
-		if (pr->nfree > 0) {
-
-		doalloc: /* comes here after getting a whole fresh page */
-
-			KASSERT(pr->freelist_offset < PAGE_SIZE);
-			prpage = PR_PAGEADDR(pr);
-			fla = prpage + pr->freelist_offset;
-			fl = (struct freelist *)fla;
-
-			retptr = fl;
-			fl = fl->next;
-			pr->nfree--;
-
-			if (fl != NULL) {
-				KASSERT(pr->nfree > 0);
-				fla = (vaddr_t)fl;
-				KASSERT(fla - prpage < PAGE_SIZE);
-				pr->freelist_offset = fla - prpage;
-			}
-			else {
-				KASSERT(pr->nfree == 0);
-				pr->freelist_offset = INVALID_OFFSET;
-			}
-
-			checksubpages();
-
-			spinlock_release(&kmalloc_spinlock);
-			return retptr;
+		while (pr->nfree > 0 && got < n) {
+			blocks[got++] = subpage_take(pr);
 		}
 	}
 
+	if (got > 0) {
+		checksubpages();
+		spinlock_release(&kmalloc_spinlock);
+		return got;
+	}
+
 	/*
 	 * No page of the right size available.
 	 * Make a new one.
@@ -464,17 +569,24 @@ subpage_kmalloc(size_t sz)
 	if (prpage==0) {
 		/* Out of memory. */
 		kprintf("kmalloc: Subpage allocator couldn't get a page\n"); 
-		return NULL;
+		return 0;
 	}
 	spinlock_acquire(&kmalloc_spinlock);
 
-	pr = allocpageref();
-	if (pr==NULL) {
-		/* Couldn't allocate accounting space for the new page. */
+	while ((pr = allocpageref()) == NULL) {
+		/*
+		 * Out of accounting space for the new page; get another
+		 * page of pagerefs. As above, without the spinlock.
+		 */
 		spinlock_release(&kmalloc_spinlock);
-		free_kpages(prpage);
-		kprintf("kmalloc: Subpage allocator couldn't get pageref\n"); 
-		return NULL;
+		prrpage = alloc_kpages(1);
+		if (prrpage==0) {
+			free_kpages(prpage);
+			kprintf("kmalloc: Subpage allocator couldn't get pageref\n"); 
+			return 0;
+		}
+		spinlock_acquire(&kmalloc_spinlock);
+		addpagerefpage(prrpage);
 	}
 
 	pr->pageaddr_and_blocktype = MKPAB(prpage, blktype);
@@ -504,13 +616,87 @@ subpage_kmalloc(size_t sz)
 	pr->next_all = allbase;
 	allbase = pr;
 
-	/* This is kind of cheesy, but avoids duplicating the alloc code. */
-	goto doalloc;
+	ph = &pagehash[PAGEHASH(prpage)];
+	spinlock_acquire(&ph->ph_lock);
+	pr->next_hash = ph->ph_head;
+	ph->ph_head = pr;
+	spinlock_release(&ph->ph_lock);
+
+	while (pr->nfree > 0 && got < n) {
+		blocks[got++] = subpage_take(pr);
+	}
+
+	checksubpages();
+
+	spinlock_release(&kmalloc_spinlock);
+	return got;
 }
 
+/*
+ * Find the pageref for the page PTR is on. Returns NULL if PTR is
+ * not a subpage block. Only the bucket lock is taken. The result
+ * stays valid after it is dropped, as long as the caller holds
+ * kmalloc_spinlock or owns an allocated block on the page.
+ */
+static
+struct pageref *
+subpage_lookup(vaddr_t ptraddr)
+{
+	struct pagehash_bucket *ph;
+	struct pageref *pr;
+	vaddr_t prpage;
+
+	prpage = ptraddr & PAGE_FRAME;
+	ph = &pagehash[PAGEHASH(prpage)];
+	spinlock_acquire(&ph->ph_lock);
+	for (pr = ph->ph_head; pr; pr = pr->next_hash) {
+		/* check for corruption */
+		KASSERT(PR_BLOCKTYPE(pr) < NSIZES);
+
+		if (PR_PAGEADDR(pr) == prpage) {
+			break;
+		}
+	}
+	spinlock_release(&ph->ph_lock);
+	return pr;
+}
+
+/*
+ * Return the size class of PTR, or -1 if it was not allocated by the
+ * subpage allocator. PTR is a block the caller is freeing, so its page
+ * cannot go away underneath us and kmalloc_spinlock is not needed;
+ * the block type never changes while the page is a subpage page.
+ */
 static
 int
-subpage_kfree(void *ptr)
+subpage_blocktype(void *ptr)
+{
+	struct pageref *pr;
+	vaddr_t offset;
+	int blktype;
+
+	pr = subpage_lookup((vaddr_t)ptr);
+	if (pr == NULL) {
+		return -1;
+	}
+	blktype = PR_BLOCKTYPE(pr);
+
+	/* Check for proper positioning and alignment */
+	offset = (vaddr_t)ptr & ~(vaddr_t)PAGE_FRAME;
+	if (offset % sizes[blktype] != 0) {
+		panic("kfree: subpage free of invalid addr %p\n", ptr);
+	}
+	return blktype;
+}
+
+/*
+ * Put N blocks back on their pages, under one acquisition of
+ * kmalloc_spinlock. Pages that become entirely free are released
+ * after the lock is dropped.
+ */
+static
+void
+subpage_putblocks(void **blocks, unsigned n)
 {
 	int blktype;		// index into sizes[] that we're using
 	vaddr_t ptraddr;	// same as ptr
@@ -519,37 +705,140 @@ subpage_kfree(void *ptr)
 	vaddr_t fla;		// free list entry address
 	struct freelist *fl;	// free list entry
 	vaddr_t offset;		// offset into page
+	vaddr_t freepages[CPU_KMALLOC_MAG];
+	unsigned i, nfreepages = 0;
 
-	ptraddr = (vaddr_t)ptr;
+	KASSERT(n <= CPU_KMALLOC_MAG);
 
 	spinlock_acquire(&kmalloc_spinlock);
 
 	checksubpages();
 
-	for (pr = allbase; pr; pr = pr->next_all) {
+	for (i=0; i<n; i++) {
+		ptraddr = (vaddr_t)blocks[i];
+		pr = subpage_lookup(ptraddr);
+		if (pr == NULL) {
+			panic("kfree: subpage block %p has no page\n",
+			      blocks[i]);
+		}
 		prpage = PR_PAGEADDR(pr);
 		blktype = PR_BLOCKTYPE(pr);
+		offset = ptraddr - prpage;
 
-		/* check for corruption */
-		KASSERT(blktype>=0 && blktype<NSIZES);
-		checksubpage(pr);
+		/*
+		 * We probably ought to check for free twice by seeing
+		 * if the block is already on the free list. But
+		 * that's expensive, so we don't.
+		 */
 
-		if (ptraddr >= prpage && ptraddr < prpage + PAGE_SIZE) {
-			break;
+		fla = prpage + offset;
+		fl = (struct freelist *)fla;
+		if (pr->freelist_offset == INVALID_OFFSET) {
+			fl->next = NULL;
+		} else {
+			fl->next = (struct freelist *)(prpage + pr->freelist_offset);
+		}
+		pr->freelist_offset = offset;
+		pr->nfree++;
+
+		KASSERT(pr->nfree <= PAGE_SIZE / sizes[blktype]);
+		if (pr->nfree == PAGE_SIZE / sizes[blktype]) {
+			/* Whole page is free. */
+			remove_lists(pr, blktype);
+			freepageref(pr);
+			freepages[nfreepages++] = prpage;
 		}
 	}
 
-	if (pr==NULL) {
-		/* Not on any of our pages - not a subpage allocation */
-		spinlock_release(&kmalloc_spinlock);
-		return -1;
+	checksubpages();
+
+	/* Call free_kpages without kmalloc_spinlock. */
+	spinlock_release(&kmalloc_spinlock);
+	for (i=0; i<nfreepages; i++) {
+		free_kpages(freepages[i]);
 	}
+}
 
-	offset = ptraddr - prpage;
+/*
+ * Per-cpu magazines.
+ *
+ * Each cpu keeps up to CPU_KMALLOC_MAG free blocks of each size class.
+ * Blocks in a magazine count as allocated as far as the pages are
+ * concerned; a miss refills, and an overflowing free drains,
+ * CPU_KMALLOC_BATCH blocks under a single acquisition of
+ * kmalloc_spinlock. Like the frame cache in the VM system, the
+ * magazine is only touched at splhigh so we can't be switched to
+ * another cpu partway through. Before the cpu structures exist
+ * (early boot) everything goes straight to the global pages.
+ */
 
-	/* Check for proper positioning and alignment */
-	if (offset >= PAGE_SIZE || offset % sizes[blktype] != 0) {
-		panic("kfree: subpage free of invalid addr %p\n", ptr);
+#if NSIZES != CPU_KMALLOC_NSIZES
+#error "CPU_KMALLOC_NSIZES does not match the subpage size classes"
+#endif
+
+static
+void *
+subpage_kmalloc(size_t sz)
+{
+	void *blocks[CPU_KMALLOC_BATCH];
+	unsigned blktype, n;
+	struct cpu *c;
+	void *ptr;
+	int spl;
+
+	blktype = blocktype(sz);
+
+	if (!CURCPU_EXISTS()) {
+		n = subpage_getblocks(blktype, blocks, 1);
+		return n ? blocks[0] : NULL;
+	}
+
+	spl = splhigh();
+	c = curcpu->c_self;
+	if (c->c_nkmag[blktype] > 0) {
+		c->c_kmalloc_hits++;
+		ptr = c->c_kmag[blktype][--c->c_nkmag[blktype]];
+		splx(spl);
+		return ptr;
+	}
+	c->c_kmalloc_misses++;
+	splx(spl);
+
+	/* may sleep in alloc_kpages; do it at our normal spl */
+	n = subpage_getblocks(blktype, blocks, CPU_KMALLOC_BATCH);
+	if (n == 0) {
+		return NULL;
+	}
+	ptr = blocks[--n];
+
+	/* we may be on a different cpu now; that's fine */
+	spl = splhigh();
+	c = curcpu->c_self;
+	while (n > 0 && c->c_nkmag[blktype] < CPU_KMALLOC_MAG) {
+		c->c_kmag[blktype][c->c_nkmag[blktype]++] = blocks[--n];
+	}
+	splx(spl);
+
+	if (n > 0) {
+		subpage_putblocks(blocks, n);
+	}
+	return ptr;
+}
+
+static
+int
+subpage_kfree(void *ptr)
+{
+	void *blocks[CPU_KMALLOC_BATCH];
+	struct cpu *c;
+	int blktype;
+	unsigned n;
+	int spl;
+
+	blktype = subpage_blocktype(ptr);
+	if (blktype < 0) {
+		/* Not on any of our pages - not a subpage allocation */
+		return -1;
 	}
 
 	/*
@@ -558,49 +847,563 @@ subpage_kfree(void *ptr)
 	 */
 	fill_deadbeef(ptr, sizes[blktype]);
 
-	/*
-	 * We probably ought to check for free twice by seeing if the block
-	 * is already on the free list. But that's expensive, so we don't.
-	 */
+	if (!CURCPU_EXISTS()) {
+		subpage_putblocks(&ptr, 1);
+		return 0;
+	}
 
-	fla = prpage + offset;
-	fl = (struct freelist *)fla;
-	if (pr->freelist_offset == INVALID_OFFSET) {
-		fl->next = NULL;
-	} else {
-		fl->next = (struct freelist *)(prpage + pr->freelist_offset);
-	}
-	pr->freelist_offset = offset;
-	pr->nfree++;
-
-	KASSERT(pr->nfree <= PAGE_SIZE / sizes[blktype]);
-	if (pr->nfree == PAGE_SIZE / sizes[blktype]) {
-		/* Whole page is free. */
-		remove_lists(pr, blktype);
-		freepageref(pr);
-		/* Call free_kpages without kmalloc_spinlock. */
-		spinlock_release(&kmalloc_spinlock);
-		free_kpages(prpage);
+	n = 0;
+	spl = splhigh();
+	c = curcpu->c_self;
+	if (c->c_nkmag[blktype] < CPU_KMALLOC_MAG) {
+		c->c_kfree_hits++;
 	}
 	else {
-		spinlock_release(&kmalloc_spinlock);
+		c->c_kfree_misses++;
+		while (n < CPU_KMALLOC_BATCH) {
+			blocks[n++] = c->c_kmag[blktype][--c->c_nkmag[blktype]];
+		}
+	}
+	c->c_kmag[blktype][c->c_nkmag[blktype]++] = ptr;
+	splx(spl);
+
+	if (n > 0) {
+		subpage_putblocks(blocks, n);
+	}
+
+	return 0;
+}
+
+static
+void
+kmag_printstats(void)
+{
+	struct cpu *c;
+	unsigned i, j, allocs, frees;
+
+	kprintf("Per-cpu kmalloc magazines:\n");
+	for (i=0; i<cpu_count(); i++) {
+		c = cpu_get(i);
+		allocs = c->c_kmalloc_hits + c->c_kmalloc_misses;
+		frees = c->c_kfree_hits + c->c_kfree_misses;
+		kprintf("  cpu%u: alloc %u/%u hits (%u%%), "
+			"free %u/%u hits (%u%%)\n   cached:", c->c_number,
+			c->c_kmalloc_hits, allocs,
+			allocs ? c->c_kmalloc_hits * 100 / allocs : 0,
+			c->c_kfree_hits, frees,
+			frees ? c->c_kfree_hits * 100 / frees : 0);
+		for (j=0; j<NSIZES; j++) {
+			kprintf(" %lu:%u", (unsigned long)sizes[j],
+				c->c_nkmag[j]);
+		}
+		kprintf("\n");
+	}
+}
+
+////////////////////////////////////////////////////////////
+//
+// Object caches.
+//
+//    Each slab is one page. The page starts with a struct kmem_slab
+//    and the rest is cut into objects of the cache's size, so the slab
+//    for any object is found by masking off the page offset. The
+//    freelist link for an object lives in a word just past the object
+//    rather than on top of it, so that a free object keeps whatever
+//    state the constructor put there.
+//
+//    Slabs with free objects are kept on a per-cache list. Full slabs
+//    are not on any list; they go back on when an object is freed.
+//    One completely free slab is kept around per cache to absorb
+//    create/destroy churn; beyond that, empty slabs are destructed and
+//    their page is handed back to the VM system.
+//
+
+struct kmem_slab {
+	struct kmem_slab *ks_next;	/* on kc_slabs */
+	struct kmem_cache *ks_cache;
+	void *ks_free;			/* first free object */
+	unsigned ks_inuse;
+};
+
+#define KMEM_SLABHDR	ROUNDUP(sizeof(struct kmem_slab), 8)
+#define KMEM_MAXEMPTY	1
+
+#define KMEM_SLAB(obj)	((struct kmem_slab *)((vaddr_t)(obj) & PAGE_FRAME))
+
+/* all caches that have ever held a slab; protected by kmalloc_spinlock */
+static struct kmem_cache *kmem_caches;
+
+static
+inline
+size_t
+kmem_linkoff(struct kmem_cache *kc)
+{
+	return ROUNDUP(kc->kc_size, sizeof(void *));
+}
+
+static
+inline
+size_t
+kmem_stride(struct kmem_cache *kc)
+{
+	return ROUNDUP(kmem_linkoff(kc) + sizeof(void *), 8);
+}
+
+static
+inline
+unsigned
+kmem_perslab(struct kmem_cache *kc)
+{
+	return (PAGE_SIZE - KMEM_SLABHDR) / kmem_stride(kc);
+}
+
+static
+inline
+void **
+kmem_link(struct kmem_cache *kc, void *obj)
+{
+	return (void **)((vaddr_t)obj + kmem_linkoff(kc));
+}
+
+/*
+ * Get a fresh page and construct every object on it. Called without
+ * kc_lock, since both alloc_kpages and the constructors may sleep or
+ * come back into kmalloc.
+ */
+static
+struct kmem_slab *
+kmem_slab_create(struct kmem_cache *kc)
+{
+	struct kmem_slab *slab;
+	vaddr_t page, obj;
+	unsigned i, j, n;
+	size_t stride;
+	int result;
+
+	n = kmem_perslab(kc);
+	stride = kmem_stride(kc);
+	KASSERT(n > 0);
+
+	page = alloc_kpages(1);
+	if (page == 0) {
+		return NULL;
+	}
+
+	slab = (struct kmem_slab *)page;
+	slab->ks_next = NULL;
+	slab->ks_cache = kc;
+	slab->ks_free = NULL;
+	slab->ks_inuse = 0;
+
+	/* build the freelist back to front so objects go out in order */
+	for (i=n; i-- > 0; ) {
+		obj = page + KMEM_SLABHDR + i*stride;
+		if (kc->kc_ctor != NULL) {
+			result = kc->kc_ctor((void *)obj);
+			if (result) {
+				for (j=i+1; j<n; j++) {
+					obj = page + KMEM_SLABHDR + j*stride;
+					if (kc->kc_dtor != NULL) {
+						kc->kc_dtor((void *)obj);
+					}
+				}
+				free_kpages(page);
+				return NULL;
+			}
+		}
+		*kmem_link(kc, (void *)obj) = slab->ks_free;
+		slab->ks_free = (void *)obj;
 	}
 
-#ifdef SLOWER /* Don't get the lock unless checksubpages does something. */
 	spinlock_acquire(&kmalloc_spinlock);
-	checksubpages();
+	if (!kc->kc_listed) {
+		kc->kc_next = kmem_caches;
+		kmem_caches = kc;
+		kc->kc_listed = true;
+	}
 	spinlock_release(&kmalloc_spinlock);
-#endif
 
-	return 0;
+	return slab;
+}
+
+/*
+ * Destruct every object on an empty slab and give its page back.
+ * Called without kc_lock.
+ */
+static
+void
+kmem_slab_destroy(struct kmem_cache *kc, struct kmem_slab *slab)
+{
+	vaddr_t page;
+	unsigned i, n;
+
+	KASSERT(slab->ks_inuse == 0);
+	page = (vaddr_t)slab;
+	n = kmem_perslab(kc);
+
+	if (kc->kc_dtor != NULL) {
+		for (i=0; i<n; i++) {
+			kc->kc_dtor((void *)(page + KMEM_SLABHDR +
+					     i*kmem_stride(kc)));
+		}
+	}
+	free_kpages(page);
+}
+
+void *
+kmem_cache_alloc(struct kmem_cache *kc)
+{
+	struct kmem_slab *slab;
+	void *obj;
+
+	spinlock_acquire(&kc->kc_lock);
+	while (kc->kc_slabs == NULL) {
+		spinlock_release(&kc->kc_lock);
+		slab = kmem_slab_create(kc);
+		if (slab == NULL) {
+			return NULL;
+		}
+		spinlock_acquire(&kc->kc_lock);
+		slab->ks_next = kc->kc_slabs;
+		kc->kc_slabs = slab;
+		kc->kc_nslabs++;
+		kc->kc_nempty++;
+		kc->kc_grows++;
+	}
+
+	slab = kc->kc_slabs;
+	KASSERT(slab->ks_cache == kc);
+	KASSERT(slab->ks_free != NULL);
+
+	obj = slab->ks_free;
+	slab->ks_free = *kmem_link(kc, obj);
+	if (slab->ks_inuse++ == 0) {
+		KASSERT(kc->kc_nempty > 0);
+		kc->kc_nempty--;
+	}
+	if (slab->ks_free == NULL) {
+		/* now full; drop it off the list */
+		kc->kc_slabs = slab->ks_next;
+		slab->ks_next = NULL;
+	}
+	kc->kc_inuse++;
+	kc->kc_allocs++;
+	spinlock_release(&kc->kc_lock);
+
+	return obj;
+}
+
+void
+kmem_cache_free(struct kmem_cache *kc, void *obj)
+{
+	struct kmem_slab *slab, **sp;
+	vaddr_t offset;
+
+	KASSERT(obj != NULL);
+	slab = KMEM_SLAB(obj);
+	offset = (vaddr_t)obj - (vaddr_t)slab;
+	if (slab->ks_cache != kc || offset < KMEM_SLABHDR ||
+	    (offset - KMEM_SLABHDR) % kmem_stride(kc) != 0) {
+		panic("kmem_cache_free: %p is not from cache %s\n",
+		      obj, kc->kc_name);
+	}
+
+	/*
+	 * Objects without a constructor have no state worth keeping;
+	 * poison them like kfree does.
+	 */
+	if (kc->kc_ctor == NULL) {
+		fill_deadbeef(obj, kc->kc_size);
+	}
+
+	spinlock_acquire(&kc->kc_lock);
+	KASSERT(slab->ks_inuse > 0);
+	if (slab->ks_free == NULL) {
+		/* was full; it has room again */
+		slab->ks_next = kc->kc_slabs;
+		kc->kc_slabs = slab;
+	}
+	*kmem_link(kc, obj) = slab->ks_free;
+	slab->ks_free = obj;
+	slab->ks_inuse--;
+	kc->kc_inuse--;
+	kc->kc_frees++;
+
+	if (slab->ks_inuse > 0) {
+		spinlock_release(&kc->kc_lock);
+		return;
+	}
+
+	if (kc->kc_nempty < KMEM_MAXEMPTY) {
+		kc->kc_nempty++;
+		spinlock_release(&kc->kc_lock);
+		return;
+	}
+
+	/* Already have a spare; give this one back. */
+	for (sp = &kc->kc_slabs; *sp != slab; sp = &(*sp)->ks_next) {
+		KASSERT(*sp != NULL);
+	}
+	*sp = slab->ks_next;
+	kc->kc_nslabs--;
+	kc->kc_reaps++;
+	spinlock_release(&kc->kc_lock);
+
+	kmem_slab_destroy(kc, slab);
+}
+
+static
+void
+kmem_printstats(void)
+{
+	struct kmem_cache *kc;
+
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+
+	kprintf("Object caches:\n");
+	kprintf("  %-12s %5s %5s %6s %6s %8s %8s %6s %6s\n",
+		"name", "size", "/slab", "inuse", "slabs",
+		"allocs", "frees", "grows", "reaps");
+	for (kc = kmem_caches; kc != NULL; kc = kc->kc_next) {
+		spinlock_acquire(&kc->kc_lock);
+		kprintf("  %-12s %5lu %5u %6u %3u/%-2u %8u %8u %6u %6u\n",
+			kc->kc_name, (unsigned long)kc->kc_size,
+			kmem_perslab(kc), kc->kc_inuse,
+			kc->kc_nslabs, kc->kc_nempty,
+			kc->kc_allocs, kc->kc_frees,
+			kc->kc_grows, kc->kc_reaps);
+		spinlock_release(&kc->kc_lock);
+	}
 }
 
 //
 ////////////////////////////////////////////////////////////
 
+#if OPT_KMALLOCSTATS
+////////////////////////////////////////////////////////////
+//
+// Allocation profiling.
+//
+//    Every kmalloc records its requested size in a histogram and
+//    against its size class (the last "class" being whole-page
+//    allocations), and charges the caller's return address in a
+//    small open-addressed table. The counters live in struct cpu and
+//    are only touched at splhigh by their own cpu, so no update is
+//    lost and kmalloc takes no shared lock or cache line for them.
+//    kheap_printsizes adds them up.
+//
+//    Resetting bumps kmstat_gen; each cpu clears its own counters
+//    the next time it records and sees a stale generation, and
+//    kheap_printsizes skips counters from an old generation.
+//    Allocations made before the cpu structures exist go into
+//    kmstat_boot.
+//
+
+#define KMSTAT_NBUCKETS CPU_KMSTAT_NBUCKETS
+#define KMSTAT_NSITES   CPU_KMSTAT_NSITES
+#define KMSTAT_TOP      10
+
+static struct kmstat kmstat_boot;
+static volatile unsigned kmstat_gen;
+
+/*
+ * Charge COUNT allocations totalling BYTES to SITE in KM's table.
+ */
+static
+void
+kmstat_addsite(struct kmstat *km, vaddr_t site, unsigned count,
+	       uint64_t bytes)
+{
+	struct kmstat_site *ks;
+	unsigned h, i;
+
+	h = (site >> 2) & (KMSTAT_NSITES - 1);
+	for (i=0; i<KMSTAT_NSITES; i++) {
+		ks = &km->km_sites[(h + i) % KMSTAT_NSITES];
+		if (ks->ks_site == 0) {
+			ks->ks_site = site;
+		}
+		if (ks->ks_site == site) {
+			ks->ks_count += count;
+			ks->ks_bytes += bytes;
+			return;
+		}
+	}
+	km->km_othersites += count;
+}
+
+static
+void
+kmstat_record(size_t sz, vaddr_t site)
+{
+	struct kmstat *km;
+	unsigned b, cls, gen;
+	size_t got;
+	int spl;
+
+	for (b=0; b<KMSTAT_NBUCKETS-1 && sz > ((size_t)8 << b); b++) {
+		/* nothing */
+	}
+	if (sz >= LARGEST_SUBPAGE_SIZE) {
+		cls = NSIZES;
+		got = ROUNDUP(sz, PAGE_SIZE);
+	}
+	else {
+		cls = blocktype(sz);
+		got = sizes[cls];
+	}
+
+	spl = splhigh();
+	km = CURCPU_EXISTS() ? &curcpu->c_self->c_kmstat : &kmstat_boot;
+	gen = kmstat_gen;
+	if (km->km_gen != gen) {
+		bzero(km, sizeof(*km));
+		km->km_gen = gen;
+	}
+	km->km_hist[b]++;
+	km->km_allocs[cls]++;
+	km->km_reqbytes[cls] += sz;
+	km->km_gotbytes[cls] += got;
+	kmstat_addsite(km, site, 1, sz);
+	splx(spl);
+}
+
+/*
+ * Add SRC into DST, unless SRC predates the last reset. SRC may be
+ * changing underneath us; we just get a slightly stale snapshot.
+ */
+static
+void
+kmstat_sum(struct kmstat *dst, const struct kmstat *src)
+{
+	const struct kmstat_site *ks;
+	unsigned i;
+
+	if (src->km_gen != dst->km_gen) {
+		return;
+	}
+	for (i=0; i<KMSTAT_NBUCKETS; i++) {
+		dst->km_hist[i] += src->km_hist[i];
+	}
+	for (i=0; i<=NSIZES; i++) {
+		dst->km_allocs[i] += src->km_allocs[i];
+		dst->km_reqbytes[i] += src->km_reqbytes[i];
+		dst->km_gotbytes[i] += src->km_gotbytes[i];
+	}
+	for (i=0; i<KMSTAT_NSITES; i++) {
+		ks = &src->km_sites[i];
+		if (ks->ks_site != 0) {
+			kmstat_addsite(dst, ks->ks_site, ks->ks_count,
+				       ks->ks_bytes);
+		}
+	}
+	dst->km_othersites += src->km_othersites;
+}
+
+void
+kheap_printsizes(void)
+{
+	struct kmstat *km;
+	struct kmstat_site *ks, *top[KMSTAT_TOP];
+	unsigned i, j, k, ntop;
+	uint64_t waste;
+
+	/* too big for the stack */
+	km = kmalloc(sizeof(*km));
+	if (km == NULL) {
+		kprintf("khs: out of memory\n");
+		return;
+	}
+	bzero(km, sizeof(*km));
+	km->km_gen = kmstat_gen;
+	kmstat_sum(km, &kmstat_boot);
+	for (i=0; i<cpu_count(); i++) {
+		kmstat_sum(km, &cpu_get(i)->c_kmstat);
+	}
+
+	kprintf("kmalloc request sizes:\n");
+	for (i=0; i<KMSTAT_NBUCKETS; i++) {
+		if (i < KMSTAT_NBUCKETS-1) {
+			kprintf("  <= %-5lu %8u\n",
+				(unsigned long)((size_t)8 << i),
+				km->km_hist[i]);
+		}
+		else {
+			kprintf("  >  %-5lu %8u\n",
+				(unsigned long)((size_t)8 << (i-1)),
+				km->km_hist[i]);
+		}
+	}
+
+	kprintf("Size classes:\n");
+	kprintf("  %-6s %8s %12s %12s %6s\n",
+		"class", "allocs", "requested", "allocated", "waste");
+	for (i=0; i<=NSIZES; i++) {
+		waste = km->km_gotbytes[i] - km->km_reqbytes[i];
+		if (i < NSIZES) {
+			kprintf("  %-6lu", (unsigned long)sizes[i]);
+		}
+		else {
+			kprintf("  %-6s", "pages");
+		}
+		kprintf(" %8u %12llu %12llu %5llu%%\n", km->km_allocs[i],
+			(unsigned long long)km->km_reqbytes[i],
+			(unsigned long long)km->km_gotbytes[i],
+			(unsigned long long)(km->km_gotbytes[i] ?
+			    waste * 100 / km->km_gotbytes[i] : 0));
+	}
+
+	/* selection of the busiest call sites */
+	ntop = 0;
+	for (i=0; i<KMSTAT_NSITES; i++) {
+		ks = &km->km_sites[i];
+		if (ks->ks_site == 0) {
+			continue;
+		}
+		for (j=0; j<ntop && top[j]->ks_count >= ks->ks_count; j++) {
+			/* nothing */
+		}
+		if (j == KMSTAT_TOP) {
+			continue;
+		}
+		if (ntop < KMSTAT_TOP) {
+			ntop++;
+		}
+		for (k=ntop-1; k>j; k--) {
+			top[k] = top[k-1];
+		}
+		top[j] = ks;
+	}
+
+	kprintf("Top kmalloc callers:\n");
+	for (i=0; i<ntop; i++) {
+		kprintf("  0x%08lx %8u allocs %10llu bytes\n",
+			(unsigned long)top[i]->ks_site, top[i]->ks_count,
+			(unsigned long long)top[i]->ks_bytes);
+	}
+	if (km->km_othersites > 0) {
+		kprintf("  (%u allocs from call sites that didn't fit)\n",
+			km->km_othersites);
+	}
+
+	kfree(km);
+}
+
+void
+kheap_resetsizes(void)
+{
+	/* each cpu clears its own counters when it next records */
+	kmstat_gen++;
+}
+#endif /* OPT_KMALLOCSTATS */
+
 void *
 kmalloc(size_t sz)
 {
+#if OPT_KMALLOCSTATS
+	kmstat_record(sz, (vaddr_t)__builtin_return_address(0));
+#endif
+
 	if (sz>=LARGEST_SUBPAGE_SIZE) {
 		unsigned long npages;
 		vaddr_t address;
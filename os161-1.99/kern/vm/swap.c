@@ -0,0 +1,131 @@
+/*
+ * Swap space management: a bitmap of page-sized slots on a raw disk.
+ * See swap.h for the interface.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <kern/stat.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <bitmap.h>
+#include <uio.h>
+#include <vnode.h>
+#include <vfs.h>
+#include <vm.h>
+#include <uw-vmstats.h>
+#include <swap.h>
+
+static struct vnode *swap_vnode;
+static struct bitmap *swap_map;
+static unsigned swap_nslots;
+static struct spinlock swap_lock = SPINLOCK_INITIALIZER;
+
+int
+swap_bootstrap(void)
+{
+	struct stat st;
+	char path[sizeof(SWAP_DEVICE)];
+	int result;
+
+	/* vfs_open may scribble on the path */
+	strcpy(path, SWAP_DEVICE);
+	result = vfs_open(path, O_RDWR, 0, &swap_vnode);
+	if (result) {
+		swap_vnode = NULL;
+		return result;
+	}
+
+	result = VOP_STAT(swap_vnode, &st);
+	if (result) {
+		vfs_close(swap_vnode);
+		swap_vnode = NULL;
+		return result;
+	}
+
+	swap_nslots = st.st_size / PAGE_SIZE;
+	swap_map = bitmap_create(swap_nslots);
+	if (swap_map == NULL) {
+		vfs_close(swap_vnode);
+		swap_vnode = NULL;
+		return ENOMEM;
+	}
+
+	kprintf("swap: %u pages on %s\n", swap_nslots, SWAP_DEVICE);
+	return 0;
+}
+
+int
+swap_alloc(unsigned *slot)
+{
+	int result;
+
+	if (swap_map == NULL) {
+		return ENOSPC;
+	}
+	spinlock_acquire(&swap_lock);
+	result = bitmap_alloc(swap_map, slot);
+	spinlock_release(&swap_lock);
+	return result ? ENOSPC : 0;
+}
+
+void
+swap_free(unsigned slot)
+{
+	KASSERT(slot < swap_nslots);
+
+	spinlock_acquire(&swap_lock);
+	KASSERT(bitmap_isset(swap_map, slot));
+	bitmap_unmark(swap_map, slot);
+	spinlock_release(&swap_lock);
+}
+
+/*
+ * Move one page between memory and a swap slot.
+ */
+static
+int
+swap_io(paddr_t paddr, unsigned slot, enum uio_rw rw)
+{
+	struct iovec iov;
+	struct uio u;
+	int result;
+
+	KASSERT(slot < swap_nslots);
+	KASSERT((paddr & PAGE_FRAME) == paddr);
+
+	uio_kinit(&iov, &u, (void *)PADDR_TO_KVADDR(paddr), PAGE_SIZE,
+		  (off_t)slot * PAGE_SIZE, rw);
+	if (rw == UIO_READ) {
+		result = VOP_READ(swap_vnode, &u);
+	}
+	else {
+		result = VOP_WRITE(swap_vnode, &u);
+	}
+	if (result) {
+		return result;
+	}
+	if (u.uio_resid != 0) {
+		return EIO;
+	}
+	return 0;
+}
+
+int
+swap_out(paddr_t paddr, unsigned slot)
+{
+	int result;
+
+	result = swap_io(paddr, slot, UIO_WRITE);
+	if (result == 0) {
+		vmstats_inc(VMSTAT_SWAP_FILE_WRITE);
+	}
+	return result;
+}
+
+int
+swap_in(paddr_t paddr, unsigned slot)
+{
+	return swap_io(paddr, slot, UIO_READ);
+}
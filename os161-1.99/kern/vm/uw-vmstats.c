@@ -33,6 +33,11 @@ static const char *stats_names[] = {
  /*  7 */ "Page Faults from ELF",
  /*  8 */ "Page Faults from Swapfile",
  /*  9 */ "Swapfile Writes",
+ /* 10 */ "Zero-pool Hits",
+ /* 11 */ "Zero-pool Misses",
+ /* 12 */ "Shared Text Page Hits",
+ /* 13 */ "TLB Fault-around Loads",
+ /* 14 */ "Swapfile Reads outside Faults",
 };
 
 
@@ -102,6 +107,7 @@ vmstats_print(void)
   int tlb_faults = 0;
   int elf_plus_swap_reads = 0;
   int disk_reads = 0;
+  int zero_allocs = 0;
 
   kprintf("VMSTATS:\n");
   for (i=0; i<VMSTAT_COUNT; i++) {
@@ -112,7 +118,9 @@ vmstats_print(void)
   free_plus_replace = stats_counts[VMSTAT_TLB_FAULT_FREE] + stats_counts[VMSTAT_TLB_FAULT_REPLACE];
   disk_plus_zeroed_plus_reload = stats_counts[VMSTAT_PAGE_FAULT_DISK] +
     stats_counts[VMSTAT_PAGE_FAULT_ZERO] + stats_counts[VMSTAT_TLB_RELOAD];
-  elf_plus_swap_reads = stats_counts[VMSTAT_ELF_FILE_READ] + stats_counts[VMSTAT_SWAP_FILE_READ];
+  /* swap reads done for fork or munmap are not page faults */
+  elf_plus_swap_reads = stats_counts[VMSTAT_ELF_FILE_READ] + stats_counts[VMSTAT_SWAP_FILE_READ] -
+    stats_counts[VMSTAT_SWAP_NOFAULT_READ];
   disk_reads = stats_counts[VMSTAT_PAGE_FAULT_DISK];
 
   kprintf("VMSTAT TLB Faults with Free + TLB Faults with Replace = %d\n", free_plus_replace);
@@ -128,6 +136,14 @@ vmstats_print(void)
       tlb_faults, disk_plus_zeroed_plus_reload); 
   }
 
+  zero_allocs = stats_counts[VMSTAT_ZERO_POOL_HIT] + stats_counts[VMSTAT_ZERO_POOL_MISS];
+  kprintf("VMSTAT Zero-pool hit rate = %d%% of %d zero-fill allocations\n",
+    zero_allocs ? stats_counts[VMSTAT_ZERO_POOL_HIT] * 100 / zero_allocs : 0,
+    zero_allocs);
+
+  kprintf("VMSTAT Frames saved by sharing text pages = %d\n",
+    stats_counts[VMSTAT_PAGECACHE_HIT]);
+
   kprintf("VMSTAT ELF File reads + Swapfile reads = %d\n", elf_plus_swap_reads);
   if (disk_reads != elf_plus_swap_reads) {
     kprintf("WARNING: ELF File reads + Swapfile reads != Page Faults (Disk) %d\n",
@@ -0,0 +1,95 @@
+/*
+ * forkbench - measure fork latency.
+ *
+ * Times three fork patterns, each repeated NFORKS times:
+ *
+ *   empty  - the child exits immediately (the fork+execv case, where
+ *            anything copied at fork time is thrown away).
+ *   read   - the child reads every page of a DATAPAGES-page buffer.
+ *   write  - the child writes every page of the buffer, so each page
+ *            has to be copied at some point.
+ *
+ * With eager copying in as_copy all three cost about the same. With
+ * copy-on-write, "empty" and "read" should be much cheaper than
+ * "write". Usage: forkbench [nforks]
+ */
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <err.h>
+
+#define NFORKS     100
+#define PAGESIZE   4096
+#define DATAPAGES  32
+
+static char data[DATAPAGES * PAGESIZE];
+
+static
+void
+child(int mode)
+{
+	volatile int sum = 0;
+	int i;
+
+	for (i=0; i<DATAPAGES; i++) {
+		if (mode == 1) {
+			sum += data[i * PAGESIZE];
+		}
+		else if (mode == 2) {
+			data[i * PAGESIZE] = (char)i;
+		}
+	}
+	_exit(0);
+}
+
+static
+void
+runtest(const char *name, int mode, int nforks)
+{
+	time_t s1, s2;
+	unsigned long ns1, ns2, usecs;
+	int i, pid, status;
+
+	__time(&s1, &ns1);
+	for (i=0; i<nforks; i++) {
+		pid = fork();
+		if (pid < 0) {
+			err(1, "fork");
+		}
+		if (pid == 0) {
+			child(mode);
+		}
+		if (waitpid(pid, &status, 0) < 0) {
+			err(1, "waitpid");
+		}
+	}
+	__time(&s2, &ns2);
+
+	usecs = (s2 - s1) * 1000000 + ns2 / 1000 - ns1 / 1000;
+	printf("forkbench: %-5s %d forks in %lu us, %lu us/fork\n",
+	       name, nforks, usecs, usecs / nforks);
+}
+
+int
+main(int argc, char *argv[])
+{
+	int i, nforks = NFORKS;
+
+	if (argc > 1) {
+		nforks = atoi(argv[1]);
+		if (nforks <= 0) {
+			errx(1, "usage: forkbench [nforks]");
+		}
+	}
+
+	/* make the parent's copy of the buffer resident */
+	for (i=0; i<DATAPAGES; i++) {
+		data[i * PAGESIZE] = 1;
+	}
+
+	runtest("empty", 0, nforks);
+	runtest("read", 1, nforks);
+	runtest("write", 2, nforks);
+	return 0;
+}
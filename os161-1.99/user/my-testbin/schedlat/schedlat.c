@@ -0,0 +1,191 @@
+/*
+ * schedlat.c
+ *
+ *	Measure how long it takes to run a short command, the way the
+ *	shell does (fork, execv /bin/true, waitpid), first on a quiet
+ *	system and then while the hogparty hogs are running.
+ *
+ *	Usage: schedlat [nhogs]
+ *
+ * The load is the one hogparty starts: /uw-testbin/xhog, yhog and
+ * zhog (nhogs of them, taken in turn, default 3). The hogs are short
+ * programs, so each one is run by a keeper process that starts it
+ * again as soon as it exits, until a little after the loaded
+ * sampling window ends. That way the command always competes with
+ * the full set of hogs.
+ *
+ * With plain round robin the command waits behind every hog for a
+ * full time slice at each step; with the multilevel feedback queue
+ * the hogs sink to the bottom level and the command should see
+ * latencies close to the quiet ones.
+ *
+ * The hogs print as they run, so the results are printed once they
+ * have all stopped.
+ */
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <err.h>
+
+#define DEFAULT_HOGS  3
+#define MAXHOGS       16
+#define NSAMPLES      20
+#define SAMPLE_SECS   5	/* length of the loaded sampling window */
+#define HOG_GRACE     1	/* keepers run this much past the window */
+
+struct result {
+	unsigned long min, max, total;
+	int n;
+};
+
+static char *targv[2] = { (char *)"true", NULL };
+static const char *hogs[3] = {
+	"/uw-testbin/xhog", "/uw-testbin/yhog", "/uw-testbin/zhog"
+};
+static int keeperpids[MAXHOGS];
+
+static
+unsigned long
+now_usec(void)
+{
+	time_t secs;
+	unsigned long nsecs;
+
+	__time(&secs, &nsecs);
+	return (unsigned long)secs * 1000000 + nsecs / 1000;
+}
+
+/*
+ * Keep hog PROG running until the clock passes STOP.
+ */
+static
+void
+keeper(const char *prog, unsigned long stop)
+{
+	char *hargv[2];
+	int pid, status;
+
+	hargv[0] = (char *)prog;
+	hargv[1] = NULL;
+	while (now_usec() < stop) {
+		pid = fork();
+		if (pid < 0) {
+			err(1, "fork");
+		}
+		if (pid == 0) {
+			execv(prog, hargv);
+			err(1, "%s", prog);
+		}
+		if (waitpid(pid, &status, 0) < 0) {
+			err(1, "waitpid");
+		}
+	}
+	_exit(0);
+}
+
+/*
+ * Time one run of /bin/true.
+ */
+static
+unsigned long
+runtrue(void)
+{
+	unsigned long t0;
+	int pid, status;
+
+	t0 = now_usec();
+	pid = fork();
+	if (pid < 0) {
+		err(1, "fork");
+	}
+	if (pid == 0) {
+		execv("/bin/true", targv);
+		_exit(1);
+	}
+	if (waitpid(pid, &status, 0) < 0) {
+		err(1, "waitpid");
+	}
+	return now_usec() - t0;
+}
+
+/*
+ * Run /bin/true NSAMPLES times, or until the clock passes STOP if
+ * that is nonzero, and collect the latencies in R.
+ */
+static
+void
+sample(struct result *r, unsigned long stop)
+{
+	unsigned long lat;
+
+	r->min = (unsigned long)-1;
+	r->max = r->total = 0;
+	r->n = 0;
+	while (stop != 0 ? now_usec() < stop : r->n < NSAMPLES) {
+		lat = runtrue();
+		r->total += lat;
+		r->n++;
+		if (lat < r->min) {
+			r->min = lat;
+		}
+		if (lat > r->max) {
+			r->max = lat;
+		}
+	}
+}
+
+static
+void
+report(const char *what, const struct result *r)
+{
+	if (r->n == 0) {
+		printf("%-10s no samples\n", what);
+		return;
+	}
+	printf("%-10s %3d runs  min %7lu us  avg %7lu us  max %7lu us\n",
+	       what, r->n, r->min, r->total / r->n, r->max);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct result quiet, loaded;
+	unsigned long start, stop;
+	int nhogs, i, status;
+
+	nhogs = DEFAULT_HOGS;
+	if (argc > 1) {
+		nhogs = atoi(argv[1]);
+	}
+	if (nhogs < 0 || nhogs > MAXHOGS) {
+		errx(1, "Usage: schedlat [nhogs], at most %d hogs", MAXHOGS);
+	}
+
+	sample(&quiet, 0);
+
+	start = now_usec();
+	stop = start + SAMPLE_SECS * 1000000UL;
+	for (i=0; i<nhogs; i++) {
+		keeperpids[i] = fork();
+		if (keeperpids[i] < 0) {
+			err(1, "fork");
+		}
+		if (keeperpids[i] == 0) {
+			keeper(hogs[i % 3], stop + HOG_GRACE * 1000000UL);
+		}
+	}
+
+	sample(&loaded, stop);
+
+	for (i=0; i<nhogs; i++) {
+		if (waitpid(keeperpids[i], &status, 0) < 0) {
+			warn("waitpid");
+		}
+	}
+
+	printf("\n");
+	report("quiet", &quiet);
+	report("hogparty", &loaded);
+	return 0;
+}